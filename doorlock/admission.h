@@ -0,0 +1,208 @@
+/*
+ * REQUEST ADMISSION
+ *
+ * Accepts new connections as they come, reads just their request line
+ * (without blocking) and classifies them, so that loop() can serve lock and
+ * unlock commands before the status polls that arrived earlier. Without it,
+ * requests are served strictly in arrival order, one per loop(), and a
+ * command waits behind every poll queued ahead of it.
+ *
+ * At most `ADMISSION_SLOTS` connections are held; further ones wait in the
+ * WiFi module until a slot frees up. A connection whose request line does not
+ * arrive within `ADMISSION_TIMEOUT` of its acceptance is closed, and so is one
+ * whose headers are not all in by then (see `getTopRequest()`).
+ *
+ * Overload control: while loop() has recently been slow, or reads are piling
+ * up, new reads are shed. They get a prewritten 503 with Retry-After as soon
+ * as their request line is in, before any parsing or HMAC check, so that the
+ * time goes to commands and the FSM instead of deepening the backlog.
+ * Commands are never shed, and neither are CORS preflights, without which a
+ * browser would not send the command that follows.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiS3.h>
+
+// Note: ADMISSION_TIMEOUT and DRAIN_BUDGET_MS (the loop budget) must be defined
+// in doorlock.ino before this header is included.
+
+// Connections held while their request line is read or they wait their turn
+const int ADMISSION_SLOTS = 6;
+// Longest request line read; the rest of a longer one is parsed as a header
+const unsigned int ADMISSION_MAX_LINE = 128;
+// Reads are shed while the average loop() (without its idle delay) takes
+// longer than this (milliseconds)...
+const unsigned long OVERLOAD_LOOP_MS = 250;
+// ...or while this many reads are already waiting
+const int OVERLOAD_READS = 3;
+
+// Sent to shed requests as is
+const char SHED_RESPONSE[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+enum AdmissionClass : uint8_t {
+  ADMISSION_READING,  // request line not complete yet
+  ADMISSION_COMMAND,  // POST, which changes a door, or its CORS preflight (OPTIONS)
+  ADMISSION_READ,     // anything else: only reports
+};
+
+struct AdmissionSlot {
+  WiFiClient client;
+  String line;  // request line, without the line break
+  AdmissionClass cls;
+  unsigned long acceptedMs;
+};
+
+struct Admission {
+  AdmissionSlot slots[ADMISSION_SLOTS];  // in order of arrival
+  int size;
+  unsigned long commandsFirst;  // commands served ahead of an earlier read
+  unsigned long shed;           // reads answered with SHED_RESPONSE
+  unsigned long loopMsX8;       // moving average of the loop() time, times 8
+};
+
+Admission admission;
+
+/**
+ * Feeds the time the last loop() iteration took (without its idle delay) into
+ * the moving average used for overload control.
+ *
+ * Input:
+ *  - ms (unsigned long): the time the iteration took.
+ *
+ * Output: None
+ */
+void admissionLoopTime(unsigned long ms) {
+  admission.loopMsX8 += ms - admission.loopMsX8 / 8;
+}
+
+/**
+ * Returns whether new reads should be shed: loop() has been slow lately, or
+ * `OVERLOAD_READS` reads are already waiting.
+ */
+bool admissionOverloaded() {
+  if (admission.loopMsX8 / 8 > OVERLOAD_LOOP_MS) return true;
+  int reads = 0;
+  for (int i = 0; i < admission.size; i++) {
+    if (admission.slots[i].cls == ADMISSION_READ) reads++;
+  }
+  return reads >= OVERLOAD_READS;
+}
+
+AdmissionClass admissionClassify(const String& line) {
+  return line.startsWith("POST ") || line.startsWith("OPTIONS ") ? ADMISSION_COMMAND
+                                                                  : ADMISSION_READ;
+}
+
+void admissionRemove(int i) {
+  for (int j = i; j + 1 < admission.size; j++) {
+    admission.slots[j] = admission.slots[j + 1];
+  }
+  admission.size--;
+  admission.slots[admission.size] = AdmissionSlot();
+}
+
+/**
+ * Accepts new connections while there are free slots, and reads whatever has
+ * arrived of the request lines that are not complete yet. Never waits for
+ * data.
+ *
+ * Input:
+ *  - server (WiFiServer&): the server to accept connections from.
+ *
+ * Output: None
+ */
+void admissionPoll(WiFiServer& server) {
+  while (admission.size < ADMISSION_SLOTS) {
+    WiFiClient client = server.accept();
+    if (!client) break;
+    AdmissionSlot& slot = admission.slots[admission.size++];
+    slot.client = client;
+    slot.line = "";
+    slot.cls = ADMISSION_READING;
+    slot.acceptedMs = millis();
+  }
+
+  for (int i = 0; i < admission.size; i++) {
+    AdmissionSlot& slot = admission.slots[i];
+    bool lineDone = false;
+    while (slot.cls == ADMISSION_READING && slot.client.available() && !lineDone) {
+      if (slot.line.length() == ADMISSION_MAX_LINE) {
+        lineDone = true;
+        break;
+      }
+      char c = slot.client.read();
+      if (c == '\n') {
+        lineDone = true;
+      } else if (c != '\r') {
+        slot.line += c;
+      }
+    }
+    if (lineDone) {
+      AdmissionClass cls = admissionClassify(slot.line);
+      if (cls == ADMISSION_READ && admissionOverloaded()) {
+        slot.client.write((const uint8_t*)SHED_RESPONSE, sizeof(SHED_RESPONSE) - 1);
+        slot.client.stop();
+        admission.shed++;
+        admissionRemove(i--);
+        continue;
+      }
+      slot.cls = cls;
+    }
+    if (slot.cls == ADMISSION_READING &&
+        (!slot.client.connected() || millis() - slot.acceptedMs > ADMISSION_TIMEOUT)) {
+      slot.client.stop();
+      admissionRemove(i--);
+    }
+  }
+}
+
+/**
+ * Takes the next connection to serve: the oldest command if there is one,
+ * otherwise the oldest read.
+ *
+ * Input:
+ *  - line (String&): set to its request line.
+ *  - acceptedMs (unsigned long&): set to when it was accepted; its headers are
+ *    due `ADMISSION_TIMEOUT` later.
+ *  - readsOnly (bool): whether to leave the commands queued and only take a read.
+ *
+ * Output: the connection, or an empty WiFiClient if no request line is complete.
+ */
+WiFiClient admissionNext(String& line, unsigned long& acceptedMs, bool readsOnly = false) {
+  int next = -1;
+  for (int i = 0; i < admission.size; i++) {
+    AdmissionClass cls = admission.slots[i].cls;
+    if (cls == ADMISSION_COMMAND && !readsOnly) {
+      if (next >= 0) admission.commandsFirst++;
+      next = i;
+      break;
+    }
+    if (cls == ADMISSION_READ && next < 0) next = i;
+  }
+  if (next < 0) return WiFiClient();
+
+  WiFiClient client = admission.slots[next].client;
+  line = admission.slots[next].line;
+  acceptedMs = admission.slots[next].acceptedMs;
+  admissionRemove(next);
+  return client;
+}
+
+/**
+ * Returns whether a read (not a command) is waiting with its request line
+ * complete.
+ */
+bool admissionHasRead() {
+  for (int i = 0; i < admission.size; i++) {
+    if (admission.slots[i].cls == ADMISSION_READ) return true;
+  }
+  return false;
+}
@@ -0,0 +1,239 @@
+/*
+ * STREAMING AUTHENTICATION
+ *
+ * Does the work of checking a request's X-Nonce and X-Signature headers while
+ * they are being read, so that little is left once the headers end:
+ *  - the HMAC key context (the key padded and hashed into the inner and outer
+ *    SHA-256 states) is worked out once at boot instead of for every request,
+ *  - the nonce is fed into the inner hash as its bytes arrive, and its leading
+ *    digits are parsed into the timestamp at the same time,
+ *  - the signature's hex digits are decoded into a fixed array as they arrive.
+ * `verifyAuthStream()` then only finishes the hash (the outer hash) and
+ * compares it in constant time.
+ *
+ * Header values are trimmed like `String::trim()` would: leading whitespace is
+ * skipped, and whitespace is only fed into the hash once something other than
+ * whitespace follows it.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoBearSSL.h>
+
+// Note: hexCharToValue() and REMOTE_LOCK_PASS must be defined in doorlock.ino
+// before this header is included.
+
+// Length of an HMAC-SHA256
+const int AUTH_MAC_LEN = 32;
+// Whitespace held back inside a nonce; a nonce with longer runs of it is rejected
+const int AUTH_MAX_PENDING_WS = 8;
+
+// The header whose value is being read
+enum AuthField : uint8_t { AUTH_FIELD_NONE, AUTH_FIELD_NONCE, AUTH_FIELD_SIGNATURE };
+
+struct AuthStream {
+  br_hmac_context hmac;  // HMAC of the nonce bytes fed so far
+  AuthField field;
+
+  // X-Nonce
+  unsigned long timestamp;  // the nonce's leading digits, as a number
+  uint16_t nonceLen;        // bytes fed into the HMAC
+  uint8_t nonceDigits;      // leading digits parsed into `timestamp`
+  bool digitsDone;          // a byte other than a digit has been seen
+  bool nonceBroken;         // too much whitespace held back
+  uint8_t pendingWs;
+  char pending[AUTH_MAX_PENDING_WS];
+
+  // X-Signature
+  unsigned char signature[AUTH_MAC_LEN];
+  uint8_t sigDigits;  // hex digits decoded into `signature`
+  bool sigEnded;      // whitespace after the digits: only more whitespace may follow
+  bool sigValid;      // nothing but hex digits and surrounding whitespace so far
+};
+
+br_hmac_key_context authKey;
+bool authKeyReady = false;
+
+/**
+ * Returns the HMAC key context of REMOTE_LOCK_PASS, working it out on the
+ * first call. Called once at boot, so that no request pays for it.
+ */
+const br_hmac_key_context& authKeyContext() {
+  if (!authKeyReady) {
+    br_hmac_key_init(&authKey, &br_sha256_vtable, REMOTE_LOCK_PASS, strlen(REMOTE_LOCK_PASS));
+    authKeyReady = true;
+  }
+  return authKey;
+}
+
+void authStreamStartNonce(AuthStream& a) {
+  br_hmac_init(&a.hmac, &authKeyContext(), 0);
+  a.timestamp = 0;
+  a.nonceLen = 0;
+  a.nonceDigits = 0;
+  a.digitsDone = false;
+  a.nonceBroken = false;
+  a.pendingWs = 0;
+}
+
+void authStreamStartSignature(AuthStream& a) {
+  memset(a.signature, 0, sizeof(a.signature));
+  a.sigDigits = 0;
+  a.sigEnded = false;
+  a.sigValid = true;
+}
+
+/**
+ * Prepares `a` for a new request, which is treated as having an empty nonce
+ * and signature until their headers are read.
+ *
+ * Input:
+ *  - a (AuthStream&): the state to reset.
+ *
+ * Output: None
+ */
+void authStreamBegin(AuthStream& a) {
+  a.field = AUTH_FIELD_NONE;
+  authStreamStartNonce(a);
+  authStreamStartSignature(a);
+}
+
+/**
+ * Checks whether the header line read so far is the name of X-Nonce or
+ * X-Signature, in which case the rest of the line is its value and must be
+ * given to `authStreamByte()`. A later header of the same name replaces the
+ * earlier one.
+ *
+ * Input:
+ *  - a (AuthStream&): the request's state.
+ *  - line (const String&): the header line read so far.
+ *
+ * Output: bool indicating whether the value of one of the two headers starts.
+ */
+bool authStreamHeader(AuthStream& a, const String& line) {
+  if (line.length() == 9 && line == "X-Nonce: ") {
+    authStreamStartNonce(a);
+    a.field = AUTH_FIELD_NONCE;
+  } else if (line.length() == 13 && line == "X-Signature: ") {
+    authStreamStartSignature(a);
+    a.field = AUTH_FIELD_SIGNATURE;
+  }
+  return a.field != AUTH_FIELD_NONE;
+}
+
+/**
+ * Consumes the next byte of the value being read.
+ *
+ * Input:
+ *  - a (AuthStream&): the request's state.
+ *  - c (char): the byte, which is not a line break.
+ *
+ * Output: None
+ */
+void authStreamByte(AuthStream& a, char c) {
+  bool ws = c == ' ' || c == '\t';
+  if (a.field == AUTH_FIELD_NONCE) {
+    if (ws) {
+      if (a.nonceLen == 0) return;
+      if (a.pendingWs == AUTH_MAX_PENDING_WS) {
+        a.nonceBroken = true;
+        return;
+      }
+      a.pending[a.pendingWs++] = c;
+      return;
+    }
+    if (a.pendingWs > 0) {
+      br_hmac_update(&a.hmac, a.pending, a.pendingWs);
+      a.nonceLen += a.pendingWs;
+      a.pendingWs = 0;
+      a.digitsDone = true;
+    }
+    br_hmac_update(&a.hmac, &c, 1);
+    a.nonceLen++;
+    if (!a.digitsDone && isDigit(c)) {
+      a.timestamp = a.timestamp * 10 + (c - '0');
+      a.nonceDigits++;
+    } else {
+      a.digitsDone = true;
+    }
+  } else if (a.field == AUTH_FIELD_SIGNATURE) {
+    if (ws) {
+      if (a.sigDigits > 0) a.sigEnded = true;
+      return;
+    }
+    int v = hexCharToValue(c);
+    if (a.sigEnded || v < 0 || a.sigDigits == AUTH_MAC_LEN * 2) {
+      a.sigValid = false;
+      return;
+    }
+    a.signature[a.sigDigits / 2] |= a.sigDigits % 2 == 0 ? v << 4 : v;
+    a.sigDigits++;
+  }
+}
+
+/**
+ * Ends the value being read, if any, at the end of its line; whitespace held
+ * back is dropped.
+ */
+void authStreamEndLine(AuthStream& a) {
+  a.field = AUTH_FIELD_NONE;
+}
+
+/**
+ * Reads a whole header value at once, for nonces and signatures that do not
+ * come in HTTP headers (e.g. over MQTT).
+ *
+ * Input:
+ *  - a (AuthStream&): the request's state.
+ *  - field (AuthField): the header the value is for.
+ *  - value (const String&): the value.
+ *
+ * Output: None
+ */
+void authStreamValue(AuthStream& a, AuthField field, const String& value) {
+  authStreamHeader(a, field == AUTH_FIELD_NONCE ? "X-Nonce: " : "X-Signature: ");
+  for (unsigned int i = 0; i < value.length(); i++) {
+    authStreamByte(a, value.charAt(i));
+  }
+  authStreamEndLine(a);
+}
+
+/**
+ * Reads a nonce that is signed together with `context`: the HMAC covers the
+ * context, then the nonce. Messages that do not come over HTTP are signed this
+ * way, with a context naming what they ask for, so that the nonce and
+ * signature of one request are no good for another. An HTTP nonce starts with
+ * a digit, so a context that does not can never be mistaken for one.
+ *
+ * Input:
+ *  - a (AuthStream&): the request's state.
+ *  - context (const String&): what the nonce is signed together with.
+ *  - nonce (const String&): the nonce.
+ *
+ * Output: None
+ */
+void authStreamContextNonce(AuthStream& a, const String& context, const String& nonce) {
+  authStreamStartNonce(a);
+  br_hmac_update(&a.hmac, context.c_str(), context.length());
+  a.field = AUTH_FIELD_NONCE;
+  for (unsigned int i = 0; i < nonce.length(); i++) {
+    authStreamByte(a, nonce.charAt(i));
+  }
+  authStreamEndLine(a);
+}
+
+/**
+ * Returns whether the nonce is a number, like `String::toInt()` would parse it
+ * (but without a sign): it starts with a digit, and is "0" if it parses as 0.
+ */
+bool authStreamNonceValid(const AuthStream& a) {
+  return !a.nonceBroken && a.nonceDigits > 0 && (a.timestamp != 0 || a.nonceLen == 1);
+}
+
+/**
+ * Returns whether the signature is exactly `AUTH_MAC_LEN` bytes of hex.
+ */
+bool authStreamSignatureValid(const AuthStream& a) {
+  return a.sigValid && a.sigDigits == AUTH_MAC_LEN * 2;
+}
@@ -1,18 +1,25 @@
 #include <ArduinoBearSSL.h>
-#include <ArduinoGraphics.h>
 #include <Arduino_LED_Matrix.h>
 #include <EEPROM.h>
+#include <limits.h>
 #include <Servo.h>
 #include <WDT.h>
 #include <WiFiS3.h>
 
 #include "utils.h"
+#include "event_queue.h"
+#include "led_frames.h"
+#include "memory_stats.h"
 #include "myservo.hpp"
 
 // This files controls whether to run testing, secrets, and other configurations
 // of the doorlock.
 #include "config.h"
 
+// Needs PROFILE_LOOP from config.h
+#include "profiler.h"
+#include "request_timing.h"
+
 #if defined(INTEGRATION_TEST) && defined(UNIT_TEST)
 #error "INTEGRATION_TEST and UNIT_TEST cannot be both defined!"
 #elif defined(INTEGRATION_TEST) || defined(UNIT_TEST)
@@ -21,22 +28,69 @@
 
 // FSM State Enum (must be defined before test headers are included)
 enum State { CALIBRATE_LOCK, CALIBRATE_UNLOCK, UNLOCK, LOCK, BUSY_WAIT, BUSY_MOVE, BAD };
+const int NUM_STATES = BAD + 1;
 
 // Command Enum
 enum Command { NONE, LOCK_CMD, UNLOCK_CMD };
 
 // Request Enum that represents the different HTTP requests the server can get
-enum Request { EMPTY, UNRECOGNIZED, STATUS, OPTIONS, LOCK_REQ, UNLOCK_REQ };
+enum Request {
+  EMPTY,
+  UNRECOGNIZED,
+  STATUS,
+  OPTIONS,
+  LOCK_REQ,
+  UNLOCK_REQ,
+  METRICS,
+  FLEET,
+  FLEET_LOCK,
+  FLEET_UNLOCK,
+  JOURNAL,
+  HISTORY,
+  REPLAY,
+  SCHEDULE,
+  SCHEDULE_CLEAR,
+  STATUS_FULL,
+  TUNABLES_REQ,
+  TUNABLE_SET,
+  BAD_REQUEST  // authenticated, but with a query parameter out of range
+};
+const int NUM_REQUEST_TYPES = BAD_REQUEST + 1;
+
+// The parts of a request besides its type: the door it is for and its query parameters
+struct RequestParams {
+  int door;
+  unsigned long from;  // GET /journal?from=
+  unsigned long to;    // GET /journal?to=
+  unsigned long relockAfter;  // POST /unlock?relock_after=
+  unsigned long every;        // POST /lock?every= and POST /unlock?every=
+  bool cbor;                  // Accept: application/cbor
+  int tunable;                // POST /tunables/<name>: the index of the tunable, or -1
+  unsigned long value;        // POST /tunables/<name>?value=
+};
 
 Command requestToCommand(Request req) {
   switch (req) {
     case EMPTY:
     case UNRECOGNIZED:
     case STATUS:
+    case METRICS:
+    case FLEET:
+    case JOURNAL:
+    case HISTORY:
+    case REPLAY:
+    case SCHEDULE:
+    case SCHEDULE_CLEAR:
+    case STATUS_FULL:
+    case TUNABLES_REQ:
+    case TUNABLE_SET:
+    case BAD_REQUEST:
       return NONE;
     case LOCK_REQ:
+    case FLEET_LOCK:
       return LOCK_CMD;
     case UNLOCK_REQ:
+    case FLEET_UNLOCK:
       return UNLOCK_CMD;
   }
 }
@@ -50,36 +104,94 @@ struct FSMState {
   Command curCmd;
 };
 
-// Timeout constant (milliseconds)
-const unsigned long TOL = 5000;  // 5 second timeout for moves
+// The parameters below marked tunable can be changed at runtime, see tunables.h
 
-// Hardcoded lock positions
-const int MAX_LOCK_ANGLE = 110;
-const int MIN_UNLOCK_ANGLE = 40;
+// Timeout constant (milliseconds); tunable
+unsigned long TOL = 5000;  // 5 second timeout for moves
 
-// Angle tolerance for position checking (degrees)
-const int ANGLE_TOLERANCE = 5;
+// Default lock positions, used until the lock is calibrated; tunable
+int MAX_LOCK_ANGLE = 110;
+int MIN_UNLOCK_ANGLE = 40;
 
-// Global FSM state (must be defined before test headers are included)
-FSMState fsmState;
+// Angle tolerance for position checking (degrees); tunable
+int ANGLE_TOLERANCE = 5;
 
-ArduinoLEDMatrix matrix;
+// Number of doors driven by this board, each with its own servo and FSM
+#ifndef NUM_DOORS
+#define NUM_DOORS 1
+#endif
 
+// Control and feedback pins of each door
+constexpr int SERVO_PINS[] = {9, 10, 11, 6};
+constexpr int FEEDBACK_PINS[] = {A0, A1, A2, A3};
+constexpr int TRANSISTOR_PINS[] = {5, 4, 7, 8};
+static_assert(NUM_DOORS >= 1 && NUM_DOORS <= sizeof(SERVO_PINS) / sizeof(SERVO_PINS[0]),
+              "NUM_DOORS must be between 1 and the number of pin sets above");
+const int calibrateBtnPin = 3;
 
+// The servo of a door. A single door has its pins compiled in, so reading its
+// position needs no pin lookups; several doors share the runtime-configured
+// pins. Both convert positions with a line fitted at calibration.
+#if NUM_DOORS == 1
+using DoorServo =
+    BasicServo<FixedPins<SERVO_PINS[0], FEEDBACK_PINS[0], TRANSISTOR_PINS[0]>, StableFilter,
+               SlopeCalibration>;
+#else
+using DoorServo = BasicServo<RuntimePins, StableFilter, SlopeCalibration>;
+#endif
 
-// Control and feedback pins
-const int servoPin = 9;
-const int feedbackPin = A0;
-const int transistorPin = 5;
-const int calibrateBtnPin = 3;
+// A door: a servo, the FSM controlling it, the position it was last seen at, and a command for it that did
+// not come with the current request (e.g. one sent to the whole fleet)
+struct Door {
+  DoorServo servo;
+  FSMState fsm;
+  int lastDeg;
+  Command pendingCmd;
+  unsigned long lastMoveMs;  // duration of the last move, or 0 if none
+};
 
-volatile bool calibrateBtnPressed = false;
+// All doors (must be defined before test headers are included)
+Door doors[NUM_DOORS];
 
-MyServo myservo(servoPin, feedbackPin, transistorPin);
+// The first door. Everything that predates multiple doors (the LED matrix, the
+// unprefixed routes and the tests) works on this one.
+FSMState& fsmState = doors[0].fsm;
+DoorServo& myservo = doors[0].servo;
+
+ArduinoLEDMatrix matrix;
+
+// Debounce state of the calibrate button
+ButtonDebounce calibrateBtn;
 
 State lastDisplayedState = BAD;  // Track last displayed state to avoid unnecessary updates
 
-const long wdtInterval = 2684;
+// Watchdog timeout (milliseconds); tunable, read when the watchdog is armed at boot
+long wdtInterval = 2684;
+// Idle wait at the end of every loop() (milliseconds); tunable
+unsigned long LOOP_DELAY = 100;
+// Warn when the time between two watchdog refreshes exceeds this percentage of
+// `wdtInterval`
+const int WDT_WARN_PERCENT = 75;
+
+// Loop budget: the longest each phase of loop() that may block is allowed to take (milliseconds). With
+// LOOP_DELAY, they add up to the longest time between two watchdog refreshes, `loopBudgetMs()`, which
+// `tunablesConsistent()` keeps below `wdtInterval`.
+// Request line and headers of the request served
+const unsigned long ADMISSION_TIMEOUT = 800;
+// Reads answered after it from the same door states
+const unsigned long DRAIN_BUDGET_MS = 100;
+// `WiFi.begin()` of a reconnect; the WiFi module keeps associating in the background after it returns
+const unsigned long RECONNECT_BEGIN_TIMEOUT = 1000;
+// TCP connection to the MQTT broker, and then again its CONNACK. MQTT only connects while the WiFi link is up,
+// so never in the same iteration as a reconnect.
+const unsigned long MQTT_CONNECT_TIMEOUT = 500;
+// Everything that does not block: door ticks, display, EEPROM writes, serial output
+const unsigned long LOOP_WORK_MS = 400;
+
+unsigned long loopBudgetMs() {
+  return LOOP_DELAY + ADMISSION_TIMEOUT + DRAIN_BUDGET_MS + max(RECONNECT_BEGIN_TIMEOUT, 2 * MQTT_CONNECT_TIMEOUT) +
+         LOOP_WORK_MS;
+}
 
 // WiFi setup
 char ssid[] = SECRET_SSID;
@@ -91,8 +203,21 @@ WiFiServer server(80);
 
 // EEPROM address for last valid timestamp
 const int EEPROM_TIMESTAMP_ADDR = 0;
-// Replay protection window (seconds)
-const unsigned long REPLAY_WINDOW = 5;
+// EEPROM address for the cached WiFi lease
+const int EEPROM_WIFI_CACHE_ADDR = 16;
+// EEPROM address of the event journal
+const int EEPROM_JOURNAL_ADDR = 1024;
+// EEPROM address of the persisted FSM input recording, right after the journal
+const int EEPROM_REPLAY_ADDR = 5120;
+// EEPROM address of the scheduled commands, right after the FSM input recording
+// of up to four doors
+const int EEPROM_SCHEDULE_ADDR = 7264;
+// EEPROM address of the persisted tunables, right after the scheduled commands
+const int EEPROM_TUNABLES_ADDR = 7360;
+// Give up on the cached WiFi lease after this many failed connection attempts
+const int WIFI_CACHE_MAX_ATTEMPTS = 3;
+// Replay protection window (seconds); tunable
+unsigned long REPLAY_WINDOW = 5;
 
 /**
  * This function converts an inputted value of type State into its String equivalent.
@@ -103,7 +228,7 @@ const unsigned long REPLAY_WINDOW = 5;
  * Output: String value that represents the current state
  * 
  */
-String stateToString(State st) {
+const char* stateToString(State st) {
   switch (st) {
     case CALIBRATE_LOCK:
       return "CALIBRATE_LOCK";
@@ -123,24 +248,97 @@ String stateToString(State st) {
 }
 
 /**
- * This function is a helper function that physically displays the current status on the Arduino's LED matrix.
+ * This function converts a Request into the route it was sent to, which is how
+ * requests are labelled in the metrics.
+ *
+ * Input:
+ *  - req (Request) : the request to convert
+ *
+ * Output: String value naming the route of the request
+ */
+const char* requestToRoute(Request req) {
+  switch (req) {
+    case EMPTY:
+      return "empty";
+    case UNRECOGNIZED:
+      return "unrecognized";
+    case STATUS:
+      return "/status";
+    case OPTIONS:
+      return "options";
+    case LOCK_REQ:
+      return "/lock";
+    case UNLOCK_REQ:
+      return "/unlock";
+    case METRICS:
+      return "/metrics";
+    case FLEET:
+      return "/fleet";
+    case FLEET_LOCK:
+      return "/fleet/lock";
+    case FLEET_UNLOCK:
+      return "/fleet/unlock";
+    case JOURNAL:
+      return "/journal";
+    case HISTORY:
+      return "/history";
+    case REPLAY:
+      return "/replay";
+    case SCHEDULE:
+      return "/schedule";
+    case SCHEDULE_CLEAR:
+      return "/schedule/clear";
+    case STATUS_FULL:
+      return "/status/full";
+    case TUNABLES_REQ:
+      return "/tunables";
+    case TUNABLE_SET:
+      return "/tunables/{name}";
+    case BAD_REQUEST:
+      return "bad_request";
+  }
+}
+
+// Needs the loop budget from above
+#include "admission.h"
+// Needs State, Request, stateToString(), requestToRoute() and wdtInterval from above
+#include "metrics.h"
+#include "wifi_cache.h"
+// Needs the tunables (TOL, ..., wdtInterval), loopBudgetMs(), doors and EEPROM_TUNABLES_ADDR from above
+#include "tunables.h"
+// Needs State, Command, stateToString(), EEPROM_JOURNAL_ADDR and metrics.h from above
+#include "journal.h"
+// Needs matrix from above
+#include "led_player.h"
+
+// LED matrix frames for the boot self test and for each FSM state, rendered at compile time
+constexpr Frame BOOT_FRAME = renderText("OK");
+constexpr Frame STATE_FRAMES[NUM_STATES] = {
+  renderText("CL"),  // CALIBRATE_LOCK
+  renderText("CU"),  // CALIBRATE_UNLOCK
+  renderText("U"),   // UNLOCK
+  renderText("L"),   // LOCK
+  renderText("BW"),  // BUSY_WAIT
+  renderText("BM"),  // BUSY_MOVE
+  renderText("!!"),  // BAD
+};
+
+// Animations: a progress bar under "BM" while moving, and a blinking "!!" in BAD
+constexpr ProgressFrames MOVE_PROGRESS_FRAMES(STATE_FRAMES[BUSY_MOVE]);
+constexpr Frame BAD_FRAMES[] = {STATE_FRAMES[BAD], renderText("")};
+const uint8_t BAD_BLINK_TICKS = 5;
+
+/**
+ * This function is a helper function that physically displays a precomputed frame on the Arduino's LED matrix.
  * 
  * Input:
- *  - text (char*) : String representing the status we aim to display on the LED matrix
+ *  - frame (const Frame&) : the frame to display, usually one rendered at compile time with `renderText()`
  * 
  * Output: None
  * 
- * Side effects: draws the given text on the Arduino's LED matrix.
+ * Side effects: draws the given frame on the Arduino's LED matrix.
  */
-void displayText(const char* text) {
-  matrix.beginDraw();
-  matrix.stroke(0xFFFFFFFF);
-  matrix.textFont(Font_4x6);
-  matrix.beginText(0, 1, 0xFFFFFF);
-  matrix.println(text);
-  matrix.endText();
-  matrix.endDraw();
-}
+void displayFrame(const Frame& frame) { matrix.loadFrame(frame.words); }
 
 /**
  * This function prints the MAC address, which is necessary for connecting the Arduino to the "Brown-Guest"
@@ -201,9 +399,29 @@ void printWifiStatus() {
 }
 
 /**
- * This function updates the Arduino's LED matrix based on the FSM state. It is called after fsmTransition()
- * to ensure the Arduino always displays the correct state. Note that it only
- * writes when the FSM state has changed compared to the last displayed state.
+ * This function picks the door the LED matrix shows, as there is only one matrix for all of them: the first
+ * door in BAD, otherwise the first one in BUSY_MOVE, otherwise the first door.
+ *
+ * Input: None
+ * Output: the index of the door to show
+ */
+int displayedDoor() {
+  int moving = -1;
+  for (int i = 0; i < NUM_DOORS; i++) {
+    State st = doors[i].fsm.currentState;
+    if (st == BAD) return i;
+    if (st == BUSY_MOVE && moving < 0) moving = i;
+  }
+  return moving < 0 ? 0 : moving;
+}
+
+/**
+ * This function updates the Arduino's LED matrix based on the FSM state of the door picked by
+ * `displayedDoor()`. It is called after fsmTransition() to ensure the Arduino always displays the correct
+ * state. Note that it only writes when that state has changed compared to the last displayed state.
+ *
+ * BUSY_MOVE and BAD are animated by the LED player's timer interrupt (a progress bar and a blinking "!!"),
+ * so for those states this only starts the animation; every other state stops it and shows a still frame.
  * 
  * Input: None
  * Output: None
@@ -213,49 +431,65 @@ void printWifiStatus() {
  * state that was displayed.
  */
 void updateMatrixDisplay() {
+  State st = doors[displayedDoor()].fsm.currentState;
   // Only update if state has changed
-  if (fsmState.currentState == lastDisplayedState) {
+  if (st == lastDisplayedState) {
     return;
   }
 
-  lastDisplayedState = fsmState.currentState;
-
-  switch (fsmState.currentState) {
-    case CALIBRATE_LOCK:
-      displayText("CL");
-      break;
-    case CALIBRATE_UNLOCK:
-      displayText("CU");
-      break;
-    case UNLOCK:
-      displayText("U");
-      break;
-    case LOCK:
-      displayText("L");
-      break;
-    case BUSY_WAIT:
-      displayText("BW");
-      break;
+  lastDisplayedState = st;
+  switch (st) {
     case BUSY_MOVE:
-      displayText("BM");
+      ledPlayerIndexed(MOVE_PROGRESS_FRAMES.frames, MATRIX_WIDTH + 1);
       break;
     case BAD:
-      displayText("!!");
+      ledPlayerCycle(BAD_FRAMES, 2, BAD_BLINK_TICKS);
+      break;
+    default:
+      ledPlayerStop();
+      displayFrame(STATE_FRAMES[st]);
       break;
   }
 }
 
 /**
- * This function serves as the ISR that is called when the button is pressed. It updates the boolean
- * `calibrateBtnPressed` to indicate that the button to calibrate the lock and unlock states have been pressed
+ * This function moves the progress bar shown during BUSY_MOVE to match how far the servo has travelled
+ * from its starting position towards its target.
+ *
+ * Input:
+ *  - door (const Door&) : the door the matrix shows, with its current position
+ *
+ * Output: None
+ *
+ * Side effect: sets the frame the LED player shows while in BUSY_MOVE. Does nothing in any other state.
+ */
+void updateMoveProgress(const Door& door) {
+  const FSMState& fsm = door.fsm;
+  if (fsm.currentState != BUSY_MOVE) {
+    return;
+  }
+
+  int from = fsm.curCmd == LOCK_CMD ? fsm.unlockDeg : fsm.lockDeg;
+  int to = fsm.curCmd == LOCK_CMD ? fsm.lockDeg : fsm.unlockDeg;
+  if (from == to) {
+    return;
+  }
+  int columns = (door.lastDeg - from) * MATRIX_WIDTH / (to - from);
+  ledPlayerSetIndex(constrain(columns, 0, MATRIX_WIDTH));
+}
+
+/**
+ * This function serves as the ISR that is called when the button is pressed or released. It debounces the edge
+ * by its timestamp and queues a press or release event, which loop() gives to the FSM in order; a timer
+ * interrupt of the same priority samples the level again after an edge taken for bounce.
  * 
  * Input: None
  * Output: None
  * 
- * Side effects: sets `calibrateBtnPressed` as true.
+ * Side effects: pushes a button event to `eventQueue`, unless the edge is contact bounce.
  */
 void calibrateBtnIsr(void){
-  calibrateBtnPressed = true;
+  buttonEdge(calibrateBtn, digitalRead(calibrateBtnPin));
 }
 
 /**
@@ -273,30 +507,6 @@ int hexCharToValue(char c) {
   return -1;
 }
 
-/**
- * This helper function takes in a String that represents a hexadecimal and attempts to 
- * convert it to a byte array. It returns a boolean indicating if it can be converted or not.
- * 
- * Input:
- *  - hex (String&) : Reference to a String value that corresponds to some hexadecimal value
- *  - output (char*) : String value that will eventually stored the converted hexadecimal (now a byte array)
- *  - outputLen (size_t) : size_t indicating the expected size of the `output` variables
- * 
- * Output: bool indicating if the conversion was successful
- * 
- */
-bool hexToBytes(const String& hex, unsigned char* output, size_t outputLen) {
-  if (hex.length() != outputLen * 2) return false;
-
-  for (size_t i = 0; i < outputLen; i++) {
-    int high = hexCharToValue(hex.charAt(i * 2));
-    int low = hexCharToValue(hex.charAt(i * 2 + 1));
-    if (high < 0 || low < 0) return false;
-    output[i] = (high << 4) | low;
-  }
-  return true;
-}
-
 /**
  * This is a helper function responsible for computing the HMAC value of a message given the message contant
  * and a key for hashing. HMAC is a hash function used to encrypt a message with a shared private key.
@@ -343,33 +553,60 @@ bool constantTimeCompare(const unsigned char* a, const unsigned char* b, size_t
   return result == 0;
 }
 
+// Needs hexCharToValue() and REMOTE_LOCK_PASS from above
+#include "auth_stream.h"
+
+/**
+ * This helper function counts how an authentication attempt ended in the metrics and journals it if it failed.
+ *
+ * Input:
+ *  - outcome (AuthOutcome) : how the authentication attempt ended
+ *
+ * Output: None
+ */
+void recordAuthOutcome(AuthOutcome outcome) {
+  metricsRecordAuth(outcome);
+  if (outcome != AUTH_OK) {
+    journalAuthFailure(outcome);
+  }
+}
+
 /**
  * This function ensure that the signature of the nonce was signed using the
- * secret key using HMAC-SHA256, and that the nonce is at least 5 seconds
- * after the last successful request's nonce.
+ * secret key using HMAC-SHA256, and that the nonce is no more than
+ * `REPLAY_WINDOW` seconds before the last persisted nonce. Most of
+ * the work was done while the headers were read (see auth_stream.h); what is
+ * left is finishing the HMAC and comparing it.
  *
  * Note that by defining the `SKIP_AUTH` macro, this function always returns
    * true (i.e. skips authentication).
  *
  * Input:
- *  - nonce (const String&): the nonce (unix timestamp) formatted as a string
- *  - signature (const String&): the signature of the nonce in hex.
+ *  - auth (AuthStream&): the nonce and signature of the request, as read.
+ *  - persist (bool): whether to store the nonce in EEPROM. Requests that only
+ *    read pass false: an EEPROM write for every status poll would slow down
+ *    the commands queued behind them, and a replayed read changes nothing.
  *
  * Output: bool value that indicates whether the authentication was successful.
  *
  * Side effect:
  * If the authentication succeeds, updates the last nonce stored EEPROM to be
- * the current nonce.
+ * the current nonce (if `persist`) and sets the journal's clock from it. If it
+ * fails, journals the failure.
  */
-bool verifyAuthentication(const String& nonce, const String& signature) {
+bool verifyAuthStream(AuthStream& auth, bool persist = true) {
+  PROFILE_SCOPE(PHASE_AUTH);
+  MicrosScope authTimer(requestTiming.authUs);
+  watchdogPhase(PHASE_AUTH);
 #ifdef SKIP_AUTH
+  recordAuthOutcome(AUTH_OK);
   return true;
 #endif
-  // Parse nonce as unsigned long
-  unsigned long requestTimestamp = nonce.toInt();
-  if (requestTimestamp == 0 && nonce != "0") {
-    Serial.print("Auth failed: invalid nonce format, nonce=");
-    Serial.println(nonce);
+  // The nonce was parsed as unsigned long while it was read
+  unsigned long requestTimestamp = auth.timestamp;
+  if (!authStreamNonceValid(auth)) {
+    Serial.println("Auth failed: invalid nonce format");
+    recordAuthOutcome(AUTH_BAD_NONCE);
     return false;
   }
 
@@ -377,62 +614,102 @@ bool verifyAuthentication(const String& nonce, const String& signature) {
   unsigned long lastTimestamp = 0;
   EEPROM.get(EEPROM_TIMESTAMP_ADDR, lastTimestamp);
 
-  // Check replay protection with 5-second window
-  if (requestTimestamp <= max(5, lastTimestamp) - 5) {
+  // Check replay protection with a REPLAY_WINDOW-second window
+  if (requestTimestamp <= max(REPLAY_WINDOW, lastTimestamp) - REPLAY_WINDOW) {
     Serial.print("Auth failed: replay/timestamp check. Request too old. Request: ");
     Serial.print(requestTimestamp);
     Serial.print(", Last: ");
     Serial.println(lastTimestamp);
+    recordAuthOutcome(AUTH_REPLAY);
     return false;
   }
 
-  // Compute expected HMAC
-  unsigned char expectedHMAC[32];  // SHA256 produces 32 bytes
-  computeHMAC(nonce, REMOTE_LOCK_PASS, expectedHMAC);
-
-  // Convert hex signature to bytes
-  unsigned char receivedHMAC[32];
-  if (!hexToBytes(signature, receivedHMAC, 32)) {
+  // The signature was decoded from hex while it was read
+  if (!authStreamSignatureValid(auth)) {
     Serial.println("Auth failed: invalid signature format");
+    recordAuthOutcome(AUTH_BAD_SIGNATURE);
     return false;
   }
 
+  // Finish the HMAC of the nonce, whose inner hash was fed while it was read
+  unsigned char expectedHMAC[AUTH_MAC_LEN];
+  br_hmac_out(&auth.hmac, expectedHMAC);
+
   // Constant-time comparison
-  if (!constantTimeCompare(expectedHMAC, receivedHMAC, 32)) {
+  if (!constantTimeCompare(expectedHMAC, auth.signature, AUTH_MAC_LEN)) {
     Serial.println("Auth failed: signature mismatch");
+    recordAuthOutcome(AUTH_MISMATCH);
     return false;
   }
 
   // Update last valid timestamp in EEPROM
-  EEPROM.put(EEPROM_TIMESTAMP_ADDR, requestTimestamp);
+  if (persist) {
+    MicrosScope persistTimer(requestTiming.noncePersistUs);
+    EEPROM.put(EEPROM_TIMESTAMP_ADDR, requestTimestamp);
+  }
+
+  journalSetTime(requestTimestamp);
 
   Serial.println("Auth success");
+  recordAuthOutcome(AUTH_OK);
   return true;
 }
 
+/**
+ * This function does the same as `verifyAuthStream()` for a nonce and signature that have already been read
+ * whole, e.g. from an MQTT message or a fleet command. The nonce is signed together with `context` (see
+ * `authStreamContextNonce()`), which names what the message asks for.
+ *
+ * Input:
+ *  - context (const String&): what the nonce is signed together with, ending with a space
+ *  - nonce (const String&): the nonce (unix timestamp) formatted as a string
+ *  - signature (const String&): the signature of the context and nonce in hex.
+ *
+ * Output: bool value that indicates whether the authentication was successful.
+ */
+bool verifyAuthentication(const String& context, const String& nonce, const String& signature) {
+  AuthStream auth;
+  authStreamBegin(auth);
+  authStreamContextNonce(auth, context, nonce);
+  authStreamValue(auth, AUTH_FIELD_SIGNATURE, signature);
+  return verifyAuthStream(auth);
+}
+
+// Needs doors, stateToString(), verifyAuthentication(), watchdogRefresh() and the loop budget from above
+#include "mqtt.h"
+// Needs State, Command and stateToString() from above
+#include "history.h"
+// Needs State, Command, FSMState, doors, ResetCause, TOL, ANGLE_TOLERANCE and EEPROM_REPLAY_ADDR
+// from above
+#include "replay.h"
+
 /**
  * This function checks if the servo motor is currently in the UNLOCKED state. It takes the current degree and compares
  * it to the expected unlock degree, with a bit of tolerance.
  * 
  * Input:
+ *  - fsm (const FSMState&) : the FSM of the door the motor belongs to
  *  - deg (int) : Integer representing the current degree of the motor
  * 
  * Output: Bool value indicating if the current motor is at the UNLOCK position
  * 
  */
-bool isAtUnlock(int deg) { return deg <= (fsmState.unlockDeg + ANGLE_TOLERANCE); }
+bool isAtUnlock(const FSMState& fsm, int deg) { return deg <= (fsm.unlockDeg + ANGLE_TOLERANCE); }
+bool isAtUnlock(int deg) { return isAtUnlock(fsmState, deg); }
 
 /**
  * This function checks if the servo motor is currently in the LOCKED state. It takes the current degree and compares
  * it to the expected lock degree, with a bit of tolerance.
  * 
  * Input:
+ *  - fsm (const FSMState&) : the FSM of the door the motor belongs to
  *  - deg (int) : Integer representing the current degree of the motor
  * 
  * Output: Bool value indicating if the current motor is at the LOCK position
  * 
  */
-bool isAtLock(int deg) { return deg >= (fsmState.lockDeg - ANGLE_TOLERANCE); }
+bool isAtLock(const FSMState& fsm, int deg) { return deg >= (fsm.lockDeg - ANGLE_TOLERANCE); }
+bool isAtLock(int deg) { return isAtLock(fsmState, deg); }
 
 /**
  * The fsmTransition() function is the key function responsible for handling the finite-state machine logic.
@@ -443,6 +720,7 @@ bool isAtLock(int deg) { return deg >= (fsmState.lockDeg - ANGLE_TOLERANCE); }
  * commenting exists for transitions; the prints should be obvious enough.
  * 
  * Input:
+ *  - door (Door&) : the door whose FSM is advanced; the overload without it advances the first door
  *  - deg (int) : Integer value representing the current motor position in degrees
  *  - millis (unsigned long) : long value indicating the current time, in milliseconds
  *  - button (bool) : bool value indicating if the calibrate button has been pressed or not
@@ -451,15 +729,19 @@ bool isAtLock(int deg) { return deg >= (fsmState.lockDeg - ANGLE_TOLERANCE); }
  * Output: None
  * 
  * Side effect:
- * Update the global `fsmState` with the updated FSM variables and the next state that the FSM should transition to.
+ * Update `door.fsm` with the updated FSM variables and the next state that the FSM should transition to.
+ * Transitions between different states are counted in the metrics, recorded in the history and the journal, and
+ * published over MQTT (if enabled). The inputs of every call are recorded for replay.
  */
-void fsmTransition(int deg, unsigned long millis, bool button, Command cmd) {
-  State nextState = fsmState.currentState;
+void fsmTransition(Door& door, int deg, unsigned long millis, bool button, Command cmd) {
+  FSMState& fsm = door.fsm;
+  State from = fsm.currentState;
+  State nextState = fsm.currentState;
 
-  switch (fsmState.currentState) {
+  switch (fsm.currentState) {
     case CALIBRATE_LOCK:
       if (button) {
-        fsmState.lockDeg = deg;
+        fsm.lockDeg = deg;
         nextState = CALIBRATE_UNLOCK;
         Serial.print("FSM: CALIBRATE_LOCK -> CALIBRATE_UNLOCK with deg=");
         Serial.println(deg);
@@ -468,7 +750,7 @@ void fsmTransition(int deg, unsigned long millis, bool button, Command cmd) {
 
     case CALIBRATE_UNLOCK:
       if (button) {
-        fsmState.unlockDeg = deg;
+        fsm.unlockDeg = deg;
         nextState = UNLOCK;
         Serial.print("FSM: CALIBRATE_UNLOCK -> UNLOCK with deg=");
         Serial.println(deg);
@@ -476,20 +758,20 @@ void fsmTransition(int deg, unsigned long millis, bool button, Command cmd) {
       break;
 
     case UNLOCK:
-      if (isAtUnlock(deg) && cmd == LOCK_CMD) {
+      if (isAtUnlock(fsm, deg) && cmd == LOCK_CMD) {
         nextState = BUSY_MOVE;
-        fsmState.startTime = millis;
-        fsmState.curCmd = cmd;
+        fsm.startTime = millis;
+        fsm.curCmd = cmd;
 #ifndef UNIT_TEST
-        myservo.attachAndWrite(fsmState.lockDeg);
+        door.servo.attachAndWrite(fsm.lockDeg);
 #endif
         Serial.print("FSM: UNLOCK -> BUSY_MOVE (locking), deg=");
         Serial.println(deg);
-      } else if (isAtLock(deg)) {
+      } else if (isAtLock(fsm, deg)) {
         nextState = LOCK;
         Serial.print("FSM: UNLOCK -> LOCK, deg=");
         Serial.println(deg);
-      } else if (!isAtLock(deg) && !isAtUnlock(deg)) {
+      } else if (!isAtLock(fsm, deg) && !isAtUnlock(fsm, deg)) {
         nextState = BUSY_WAIT;
         Serial.print("FSM: UNLOCK -> BUSY_WAIT (manual turn detected), deg=");
         Serial.println(deg);
@@ -497,20 +779,20 @@ void fsmTransition(int deg, unsigned long millis, bool button, Command cmd) {
       break;
 
     case LOCK:
-      if (isAtLock(deg) && cmd == UNLOCK_CMD) {
+      if (isAtLock(fsm, deg) && cmd == UNLOCK_CMD) {
         nextState = BUSY_MOVE;
-        fsmState.startTime = millis;
-        fsmState.curCmd = cmd;
+        fsm.startTime = millis;
+        fsm.curCmd = cmd;
 #ifndef UNIT_TEST
-        myservo.attachAndWrite(fsmState.unlockDeg);
+        door.servo.attachAndWrite(fsm.unlockDeg);
 #endif
         Serial.print("FSM: LOCK -> BUSY_MOVE (unlocking), deg=");
         Serial.println(deg);
-      } else if (isAtUnlock(deg)) {
+      } else if (isAtUnlock(fsm, deg)) {
         nextState = UNLOCK;
         Serial.print("FSM: LOCK -> UNLOCK, deg=");
         Serial.println(deg);
-      } else if (!isAtLock(deg) && !isAtUnlock(deg)) {
+      } else if (!isAtLock(fsm, deg) && !isAtUnlock(fsm, deg)) {
         nextState = BUSY_WAIT;
         Serial.print("FSM: LOCK -> BUSY_WAIT (manual turn detected), deg=");
         Serial.println(deg);
@@ -519,11 +801,11 @@ void fsmTransition(int deg, unsigned long millis, bool button, Command cmd) {
 
     case BUSY_WAIT:
       // No timeout - user can manually turn for as long as they want
-      if (isAtUnlock(deg)) {
+      if (isAtUnlock(fsm, deg)) {
         nextState = UNLOCK;
         Serial.print("FSM: BUSY_WAIT -> UNLOCK, deg=");
         Serial.println(deg);
-      } else if (isAtLock(deg)) {
+      } else if (isAtLock(fsm, deg)) {
         nextState = LOCK;
         Serial.print("FSM: BUSY_WAIT -> LOCK, deg=");
         Serial.println(deg);
@@ -532,22 +814,22 @@ void fsmTransition(int deg, unsigned long millis, bool button, Command cmd) {
       break;
 
     case BUSY_MOVE:
-      if (millis - fsmState.startTime > TOL) {
+      if (millis - fsm.startTime > TOL) {
         nextState = BAD;
-        myservo.detach();
+        door.servo.detach();
         Serial.println("FSM: BUSY_MOVE -> BAD (timeout)");
-      } else if (fsmState.curCmd == UNLOCK_CMD && isAtUnlock(deg)) {
+      } else if (fsm.curCmd == UNLOCK_CMD && isAtUnlock(fsm, deg)) {
         nextState = UNLOCK;
-        fsmState.curCmd = NONE;
+        fsm.curCmd = NONE;
 #ifndef UNIT_TEST
-        myservo.detach();
+        door.servo.detach();
 #endif
         Serial.println("FSM: BUSY_MOVE -> UNLOCK");
-      } else if (fsmState.curCmd == LOCK_CMD && isAtLock(deg)) {
+      } else if (fsm.curCmd == LOCK_CMD && isAtLock(fsm, deg)) {
         nextState = LOCK;
-        fsmState.curCmd = NONE;
+        fsm.curCmd = NONE;
 #ifndef UNIT_TEST
-        myservo.detach();
+        door.servo.detach();
 #endif
         Serial.println("FSM: BUSY_MOVE -> LOCK");
       }
@@ -557,44 +839,241 @@ void fsmTransition(int deg, unsigned long millis, bool button, Command cmd) {
       // Stay in BAD state - requires manual reset
       Serial.println("FSM: In BAD state - reset required");
 #ifndef UNIT_TEST
-      myservo.detach();
+      door.servo.detach();
 #endif
       break;
   }
 
-  fsmState.currentState = nextState;
+  if (nextState != fsm.currentState) {
+    metricsRecordTransition(fsm.currentState, nextState);
+    mqttRecordTransition(door, nextState);
+    historyRecord(&door - doors, fsm.currentState, nextState, deg, millis, cmd);
+#ifndef UNIT_TEST
+    journalAppend(JOURNAL_TRANSITION, &door - doors, fsm.currentState << 4 | nextState);
+#endif
+    if (fsm.currentState == BUSY_MOVE) {
+      door.lastMoveMs = millis - fsm.startTime;
+      metrics.moveMs.observe(door.lastMoveMs);
+    }
+  }
+
+  fsm.currentState = nextState;
+#ifndef UNIT_TEST
+  replayRecord(&door - doors, fsm, from, deg, millis, button, cmd);
+#endif
+}
+
+void fsmTransition(int deg, unsigned long millis, bool button, Command cmd) {
+  fsmTransition(doors[0], deg, millis, button, cmd);
+}
+
+/**
+ * This function assigns each door its pins and initializes its servo hardware.
+ *
+ * Input: None
+ * Output: None
+ */
+void initDoors() {
+  for (int i = 0; i < NUM_DOORS; i++) {
+    doors[i].servo.assignPins(SERVO_PINS[i], FEEDBACK_PINS[i], TRANSISTOR_PINS[i]);
+    doors[i].servo.init();
+  }
+}
+
+/**
+ * This function is the door scheduler: it reads the position of some of the doors and advances their FSMs. A
+ * call ticks
+ *  - the door the current request is for, and every door with a pending command, so that commands are acted
+ *    on right away,
+ *  - every door in BUSY_MOVE, so that arrivals and timeouts are noticed without delay,
+ *  - the first door waiting for calibration, if the calibrate button was pressed (it gets the press),
+ *  - one more door in round-robin order, so that idle doors are still watched for manual turns.
+ * This keeps the number of (slow) ADC reads per loop() small no matter how many doors there are, and the
+ * latency of a command independent of `NUM_DOORS`.
+ *
+ * Input:
+ *  - reqDoor (int) : the door the current request is for, or -1 if there is no request
+ *  - cmd (Command) : the command for `reqDoor`
+ *  - button (bool) : whether the calibrate button has been pressed
+ *  - buttonMs (unsigned long) : when it was pressed; the time of the transition it causes (the position is
+ *    still the one read when the door is ticked)
+ *
+ * Output: None
+ *
+ * Side effects: updates the FSM, `lastDeg` and `pendingCmd` of the doors that are ticked, and
+ * `requestTiming.fsmUs`; journals the commands given to them.
+ */
+void tickDoors(int reqDoor, Command cmd, bool button, unsigned long buttonMs) {
+  static int nextIdleDoor = 0;
+  int idleDoor = nextIdleDoor;
+  nextIdleDoor = (nextIdleDoor + 1) % NUM_DOORS;
+
+  int buttonDoor = -1;
+  for (int i = 0; button && i < NUM_DOORS; i++) {
+    State st = doors[i].fsm.currentState;
+    if (st == CALIBRATE_LOCK || st == CALIBRATE_UNLOCK) {
+      buttonDoor = i;
+      break;
+    }
+  }
+
+  requestTiming.fsmUs = 0;
+  for (int i = 0; i < NUM_DOORS; i++) {
+    Door& door = doors[i];
+    if (i != reqDoor && i != buttonDoor && i != idleDoor && door.fsm.currentState != BUSY_MOVE &&
+        door.pendingCmd == NONE) {
+      continue;
+    }
+    Command doorCmd = (i == reqDoor && cmd != NONE) ? cmd : door.pendingCmd;
+    door.pendingCmd = NONE;
+    if (doorCmd != NONE) {
+      journalAppend(JOURNAL_COMMAND, i, doorCmd);
+    }
+
+    // Get current servo position
+    watchdogPhase(PHASE_DEG);
+    PROFILE_BEGIN(PHASE_DEG);
+    door.lastDeg = door.servo.deg();
+    PROFILE_END(PHASE_DEG);
+
+    // Run FSM transition
+    watchdogPhase(PHASE_FSM);
+    PROFILE_BEGIN(PHASE_FSM);
+    unsigned long fsmStart = micros();
+    fsmTransition(door, door.lastDeg, i == buttonDoor ? buttonMs : millis(), i == buttonDoor, doorCmd);
+    requestTiming.fsmUs += micros() - fsmStart;
+    PROFILE_END(PHASE_FSM);
+  }
+}
+
+// Needs doors, Command, stateToString(), computeHMAC(), verifyAuthentication(), journalNow() and
+// requestTiming from above
+#include "fleet.h"
+// Needs doors, Request, RequestParams, requestToCommand() and journalNow() from above
+#include "scheduler.h"
+// Needs doors and stateToString() from above
+#include "status.h"
+
+/**
+ * This helper function parses the part of a request line that follows "/doors/", i.e. "{id}/{action} HTTP/1.1".
+ *
+ * Input:
+ *  - line (const String&) : the request line
+ *  - start (int) : index in `line` where the door id starts
+ *  - action (String&) : set to the action, e.g. "lock" or "status"
+ *
+ * Output: the door id, or -1 if the id is malformed or there is no such door
+ */
+int parseDoorRoute(const String& line, int start, String& action) {
+  int slash = line.indexOf('/', start);
+  if (slash <= start) return -1;
+  for (int i = start; i < slash; i++) {
+    if (!isDigit(line.charAt(i))) return -1;
+  }
+  int door = line.substring(start, slash).toInt();
+  if (door >= NUM_DOORS) return -1;
+
+  int end = line.indexOf(' ', slash);
+  int query = line.indexOf('?', slash);
+  if (query >= 0 && (end < 0 || query < end)) end = query;
+  action = line.substring(slash + 1, end < 0 ? line.length() : end);
+  return door;
+}
+
+/**
+ * This helper function reads an unsigned number from the query string of a request line, e.g. `from` in
+ * "GET /journal?from=1700000000&to=1800000000 HTTP/1.1".
+ *
+ * Input:
+ *  - line (const String&) : the request line
+ *  - name (const char*) : the name of the query parameter
+ *  - fallback (unsigned long) : returned if the parameter is missing or not a number
+ *
+ * Output: the value of the parameter, or `fallback`
+ */
+unsigned long queryParam(const String& line, const char* name, unsigned long fallback) {
+  int query = line.indexOf('?');
+  int end = line.indexOf(' ', query);
+  if (query < 0) return fallback;
+  if (end < 0) end = line.length();
+
+  String key = String(name) + "=";
+  for (int i = query + 1; i < end;) {
+    int amp = line.indexOf('&', i);
+    if (amp < 0 || amp > end) amp = end;
+    String param = line.substring(i, amp);
+    if (param.startsWith(key) && param.length() > key.length()) {
+      for (unsigned j = key.length(); j < param.length(); j++) {
+        if (!isDigit(param.charAt(j))) return fallback;
+      }
+      return strtoul(param.c_str() + key.length(), nullptr, 10);
+    }
+    i = amp + 1;
+  }
+  return fallback;
 }
 
 /**
  * This function is simply responsible for handling all WiFi requests sent by the client to the current Arduino server.
  * Evidently, it parses the request, determines the type of request (GET, POST, OPTIONS, etc.), and sets necessary variables
  * to determine what to send back to the client.
+ *
+ * Every door has its own routes, `/doors/{id}/lock`, `/doors/{id}/unlock`, `/doors/{id}/status` and
+ * `/doors/{id}/status/full`; the routes without the prefix address the first door.
  * 
  * Input:
  *  - client (WiFiClient&) : Reference to a WiFiClient, which represents the Arduino server in our application
+ *  - params (RequestParams&) : set to the door the request is for and its query parameters
+ *  - requestLine (const String&) : the request line, if it has already been read from `client` (see admission.h)
+ *  - acceptedMs (unsigned long) : when `client` was accepted
+ *  - timeoutMs (unsigned long) : headers that are not all in this long after `acceptedMs` are given up on
  * 
  * Output: Request object that represents the current type of request sent. `Request` is an enum defined with set states 
  * 
- * Side effect: clears the buffer in the `client`.
+ * Side effect: clears the buffer in the `client`, or closes it if its headers are late.
  */
-Request getTopRequest(WiFiClient& client) {
+Request getTopRequest(WiFiClient& client, RequestParams& params, const String& requestLine,
+                      unsigned long acceptedMs, unsigned long timeoutMs = ADMISSION_TIMEOUT) {
+  params = RequestParams{0, 0, ULONG_MAX, 0, 0, false, -1, 0};
   if (!client) return EMPTY;
 
   // Serial.println("new client");
-  String nonce = "";
-  String signature = "";
+  AuthStream auth;
+  authStreamBegin(auth);
   bool isStatus = false;
+  bool isStatusFull = false;
+  bool isTunables = false;
+  bool isTunableSet = false;
   bool isPostLock = false;
   bool isPostUnlock = false;
   bool isOptions = false;
-
-  String currentLine = "";
+  bool isMetrics = false;
+  bool isFleet = false;
+  bool isFleetLock = false;
+  bool isFleetUnlock = false;
+  bool isJournal = false;
+  bool isHistory = false;
+  bool isReplay = false;
+  bool isSchedule = false;
+  bool isScheduleClear = false;
+
+  // An already read request line is parsed first, as if it had just been received
+  String currentLine = requestLine;
+  bool lineRead = requestLine.length() > 0;
   while (client.connected()) {
-    if (client.available()) {
-      char c = client.read();
+    // A client that stops sending must not hold up loop() (and set off the watchdog)
+    if (millis() - acceptedMs > timeoutMs) {
+      Serial.println("Request headers timed out");
+      client.stop();
+      return EMPTY;
+    }
+    if (lineRead || client.available()) {
+      char c = lineRead ? '\n' : client.read();
+      lineRead = false;
       // Serial.write(c);
 
       if (c == '\n') {
+        authStreamEndLine(auth);
         // End of the headers of this request, we ignore request bodies.
         if (currentLine.length() == 0) {
           // Only process the top request in the buffer
@@ -602,12 +1081,36 @@ Request getTopRequest(WiFiClient& client) {
 
           if (isOptions) {
             return OPTIONS;
-          } else if (isPostLock && verifyAuthentication(nonce, signature)) {
-            return LOCK_REQ;
-          } else if (isPostUnlock && verifyAuthentication(nonce, signature)) {
-            return UNLOCK_REQ;
-          } else if (isStatus && verifyAuthentication(nonce, signature)) {
+          } else if (isPostLock && verifyAuthStream(auth)) {
+            return scheduleParamsValid(params) ? LOCK_REQ : BAD_REQUEST;
+          } else if (isPostUnlock && verifyAuthStream(auth)) {
+            return scheduleParamsValid(params) ? UNLOCK_REQ : BAD_REQUEST;
+          } else if (isStatus && verifyAuthStream(auth, false)) {
             return STATUS;
+          } else if (isStatusFull && verifyAuthStream(auth, false)) {
+            return STATUS_FULL;
+          } else if (isMetrics && verifyAuthStream(auth, false)) {
+            return METRICS;
+          } else if (isFleet && verifyAuthStream(auth, false)) {
+            return FLEET;
+          } else if (isFleetLock && verifyAuthStream(auth)) {
+            return FLEET_LOCK;
+          } else if (isFleetUnlock && verifyAuthStream(auth)) {
+            return FLEET_UNLOCK;
+          } else if (isJournal && verifyAuthStream(auth, false)) {
+            return JOURNAL;
+          } else if (isHistory && verifyAuthStream(auth, false)) {
+            return HISTORY;
+          } else if (isReplay && verifyAuthStream(auth, false)) {
+            return REPLAY;
+          } else if (isSchedule && verifyAuthStream(auth, false)) {
+            return SCHEDULE;
+          } else if (isScheduleClear && verifyAuthStream(auth)) {
+            return SCHEDULE_CLEAR;
+          } else if (isTunables && verifyAuthStream(auth, false)) {
+            return TUNABLES_REQ;
+          } else if (isTunableSet && verifyAuthStream(auth)) {
+            return TUNABLE_SET;
           } else {
             // If authentication fails, treat as an unrecognized request (i.e.
             // 403 access forbidden), similar to how GitHub treats access to
@@ -618,9 +1121,30 @@ Request getTopRequest(WiFiClient& client) {
           // Parse headers
           if (currentLine.startsWith("OPTIONS /lock") ||
               currentLine.startsWith("OPTIONS /unlock") ||
-              currentLine.startsWith("OPTIONS /status")) {
+              currentLine.startsWith("OPTIONS /status") ||
+              currentLine.startsWith("OPTIONS /metrics") ||
+              currentLine.startsWith("OPTIONS /journal") ||
+              currentLine.startsWith("OPTIONS /history") ||
+              currentLine.startsWith("OPTIONS /replay") ||
+              currentLine.startsWith("OPTIONS /schedule") ||
+              currentLine.startsWith("OPTIONS /tunables") ||
+              currentLine.startsWith("OPTIONS /doors/") ||
+              currentLine.startsWith("OPTIONS /fleet")) {
             isOptions = true;
             // Serial.println("Received OPTIONS request");
+          } else if (currentLine.startsWith("GET /doors/") || currentLine.startsWith("POST /doors/")) {
+            bool isGet = currentLine.startsWith("GET");
+            String action;
+            int id = parseDoorRoute(currentLine, isGet ? 11 : 12, action);
+            if (id >= 0) {
+              params.door = id;
+              isStatus = isGet && action == "status";
+              isStatusFull = isGet && action == "status/full";
+              isPostLock = !isGet && action == "lock";
+              isPostUnlock = !isGet && action == "unlock";
+            }
+          } else if (currentLine.startsWith("GET /status/full")) {
+            isStatusFull = true;
           } else if (currentLine.startsWith("GET /status")) {
             isStatus = true;
             // Serial.println("Received GET /status");
@@ -633,22 +1157,57 @@ Request getTopRequest(WiFiClient& client) {
           } else if (currentLine.startsWith("POST /unlock")) {
             isPostUnlock = true;
             // Serial.println("Received UNLOCK request");
-          } else if (currentLine.startsWith("X-Nonce: ")) {
-            nonce = currentLine.substring(9);
-            nonce.trim();
-            // Serial.print("Nonce: ");
-            // Serial.println(nonce);
-          } else if (currentLine.startsWith("X-Signature: ")) {
-            signature = currentLine.substring(13);
-            signature.trim();
-            // Serial.print("Signature: ");
-            // Serial.println(signature);
+          } else if (currentLine.startsWith("GET /metrics")) {
+            isMetrics = true;
+          } else if (currentLine.startsWith("GET /journal")) {
+            isJournal = true;
+            params.from = queryParam(currentLine, "from", 0);
+            params.to = queryParam(currentLine, "to", ULONG_MAX);
+          } else if (currentLine.startsWith("GET /history")) {
+            isHistory = true;
+          } else if (currentLine.startsWith("GET /replay")) {
+            isReplay = true;
+          } else if (currentLine.startsWith("GET /schedule")) {
+            isSchedule = true;
+          } else if (currentLine.startsWith("POST /schedule/clear")) {
+            isScheduleClear = true;
+          } else if (currentLine.startsWith("GET /tunables")) {
+            isTunables = true;
+          } else if (currentLine.startsWith("POST /tunables/")) {
+            isTunableSet = true;
+            int end = 15;
+            while (end < (int)currentLine.length() && currentLine.charAt(end) != ' ' &&
+                   currentLine.charAt(end) != '?') {
+              end++;
+            }
+            params.tunable = tunableFind(currentLine.substring(15, end));
+            params.value = queryParam(currentLine, "value", ULONG_MAX);
+#ifdef FLEET_GATEWAY
+          } else if (currentLine.startsWith("GET /fleet")) {
+            isFleet = true;
+          } else if (currentLine.startsWith("POST /fleet/lock")) {
+            isFleetLock = true;
+          } else if (currentLine.startsWith("POST /fleet/unlock")) {
+            isFleetUnlock = true;
+#endif
+          } else if (currentLine.startsWith("Accept: ")) {
+            params.cbor = currentLine.indexOf("application/cbor") >= 0;
+          }
+          if (currentLine.startsWith("POST /")) {
+            params.relockAfter = queryParam(currentLine, "relock_after", 0);
+            params.every = queryParam(currentLine, "every", 0);
           }
 
           currentLine = "";
         }
       } else if (c != '\r') {
-        currentLine += c;
+        // The values of X-Nonce and X-Signature go to the authentication as they arrive
+        if (auth.field != AUTH_FIELD_NONE) {
+          authStreamByte(auth, c);
+        } else {
+          currentLine += c;
+          authStreamHeader(auth, currentLine);
+        }
       }
     }
   }
@@ -659,23 +1218,24 @@ Request getTopRequest(WiFiClient& client) {
 }
 
 /**
- * This function is responsible for generating the proper response to send back to the server based on the results of 
- * a previous request. It is a general helper function that can be used for any type of request.
- * 
+ * This function writes the status line and headers of an HTTP response, up to and including the blank line
+ * that separates them from the body. The caller is responsible for writing the body, if any.
+ *
  * Input:
- *  - client (WiFiClient&) : Reference to a WiFiClient that corresponds to a client that sent a request to the server;
- *                           is responsible for receiving requests and sending responses back.
+ *  - client (Print&) : where the response is written; usually the WiFiClient that sent the request.
  *  - code (int) : represents the status code that should be sent back to the client
- *  - body (String) : String representing the body that should be sent back to the client
- *  - extraHeaders (String) : String representing header content that will also be sent back to the client in the same response.
+ *  - codeName (const char*) : the reason phrase that goes with `code`
+ *  - contentType (const char*) : the value of the Content-type header
+ *  - extraHeaders (const String&) : String representing header content that will also be sent back to the client in
+ *                                   the same response.
  *
  * Output: None
  *
  * Side effect:
- * Append the `client`'s (send) buffer with the header and contents of the HTTP
- * response.
+ * Append the `client`'s (send) buffer with the header of the HTTP response.
  */
-void respondHTTP(WiFiClient& client, int code, String codeName, String body, String extraHeaders) {
+void respondHTTPHeaders(Print& client, int code, const char* codeName, const char* contentType,
+                        const String& extraHeaders) {
   // Line 1
   client.print("HTTP/1.1 ");
   client.print(code);
@@ -683,7 +1243,8 @@ void respondHTTP(WiFiClient& client, int code, String codeName, String body, Str
   client.println(codeName);
 
   // Line 2
-  client.println("Content-type:text/plain");
+  client.print("Content-type:");
+  client.println(contentType);
 
   // Line 3
   client.println("Access-Control-Allow-Origin: *");
@@ -693,7 +1254,30 @@ void respondHTTP(WiFiClient& client, int code, String codeName, String body, Str
     client.println(extraHeaders);
   }
 
+  writeRequestTimingHeaders(client);
+
   client.println();
+}
+
+/**
+ * This function is responsible for generating the proper response to send back to the server based on the results of 
+ * a previous request. It is a general helper function that can be used for any type of request.
+ * 
+ * Input:
+ *  - client (WiFiClient&) : Reference to a WiFiClient that corresponds to a client that sent a request to the server;
+ *                           is responsible for receiving requests and sending responses back.
+ *  - code (int) : represents the status code that should be sent back to the client
+ *  - body (String) : String representing the body that should be sent back to the client
+ *  - extraHeaders (String) : String representing header content that will also be sent back to the client in the same response.
+ *
+ * Output: None
+ *
+ * Side effect:
+ * Append the `client`'s (send) buffer with the header and contents of the HTTP
+ * response.
+ */
+void respondHTTP(WiFiClient& client, int code, String codeName, String body, String extraHeaders) {
+  respondHTTPHeaders(client, code, codeName.c_str(), "text/plain", extraHeaders);
   if (body.length() > 0) {
     // Body
     client.println(body);
@@ -708,6 +1292,7 @@ void respondHTTP(WiFiClient& client, int code, String codeName, String body, Str
  *  - client (WifiClient&): the client that this request came from.
  *  - req (Request): the type of the client's request.
  *  - st (State): the current state of the FSM.
+ *  - params (const RequestParams&): the door and query parameters of the request.
  *
  * Output: None
  *
@@ -715,32 +1300,258 @@ void respondHTTP(WiFiClient& client, int code, String codeName, String body, Str
  * Sends a HTTP response back to the client depending on the request and the
  * current FSM's state.
  */
-void respondRequest(WiFiClient& client, Request req, State st) {
+void respondRequest(WiFiClient& client, Request req, State st, const RequestParams& params) {
   if (req == EMPTY) return;
   assert(client);
 
+  int code;
   if (req == OPTIONS) {
-    respondHTTP(client, 204, "No Content", "",
+    code = 204;
+    respondHTTP(client, code, "No Content", "",
                 "Access-Control-Allow-Headers: Content-Type, X-Nonce, "
                 "X-Signature\nAccess-Control-Allow-Methods: GET, POST, OPTIONS");
   } else if (req == LOCK_REQ && (st == LOCK || st == BUSY_MOVE)) {
-    respondHTTP(client, 200, "OK", stateToString(st), "");
+    code = 200;
+    respondHTTP(client, code, "OK", stateToString(st), "");
   } else if (req == UNLOCK_REQ && (st == UNLOCK || st == BUSY_MOVE)) {
-    respondHTTP(client, 200, "OK", stateToString(st), "");
+    code = 200;
+    respondHTTP(client, code, "OK", stateToString(st), "");
   } else if (req == UNRECOGNIZED) {
-    respondHTTP(client, 403, "Forbidden", "", "");
+    code = 403;
+    respondHTTP(client, code, "Forbidden", "", "");
   } else if (req == STATUS) {
-    respondHTTP(client, 200, "OK", stateToString(st), "");
+    code = 200;
+    respondHTTP(client, code, "OK", stateToString(st), "");
+  } else if (req == STATUS_FULL) {
+    code = 200;
+    BufferedPrint out(client);  // flushed when it goes out of scope
+    respondHTTPHeaders(out, code, "OK", params.cbor ? "application/cbor" : "application/json",
+                       "Vary: Accept");
+    writeFullStatus(out, params.door, params.cbor);
+  } else if (req == METRICS) {
+    code = 200;
+    BufferedPrint out(client);  // flushed when it goes out of scope
+    respondHTTPHeaders(out, code, "OK", "text/plain; version=0.0.4", "");
+    updateMemoryStats();
+    writeMetrics(out);
+  } else if (req == JOURNAL) {
+    code = 200;
+    BufferedPrint out(client);  // flushed when it goes out of scope
+    respondHTTPHeaders(out, code, "OK", "text/csv", "");
+    writeJournal(out, params.from, params.to);
+  } else if (req == HISTORY) {
+    code = 200;
+    BufferedPrint out(client);  // flushed when it goes out of scope
+    respondHTTPHeaders(out, code, "OK", "text/csv", "");
+    writeHistory(out);
+  } else if (req == REPLAY) {
+    ReplayDumpHeader header;
+    if (replayReadHeader(header)) {
+      code = 200;
+      BufferedPrint out(client);  // flushed when it goes out of scope
+      respondHTTPHeaders(out, code, "OK", "application/octet-stream", "");
+      writeReplayDump(out, header);
+    } else {
+      code = 404;
+      respondHTTP(client, code, "Not Found", "No FSM input recording stored", "");
+    }
+  } else if (req == SCHEDULE) {
+    code = 200;
+    BufferedPrint out(client);  // flushed when it goes out of scope
+    respondHTTPHeaders(out, code, "OK", "text/csv", "");
+    writeSchedule(out);
+  } else if (req == SCHEDULE_CLEAR) {
+    code = 200;
+    respondHTTP(client, code, "OK", "Schedule cleared", "");
+  } else if (req == TUNABLES_REQ) {
+    code = 200;
+    BufferedPrint out(client);  // flushed when it goes out of scope
+    respondHTTPHeaders(out, code, "OK", "text/csv", "");
+    writeTunables(out);
+  } else if (req == BAD_REQUEST) {
+    code = 400;
+    respondHTTP(client, code, "Bad Request",
+                "relock_after must be at most " + String(SCHEDULE_MAX_DELAY) + " and every between " +
+                    String(SCHEDULE_MIN_EVERY) + " and " + String(SCHEDULE_MAX_DELAY) + " seconds",
+                "");
+  } else if (req == TUNABLE_SET) {
+    if (tunableSet(params.tunable, params.value)) {
+      code = 200;
+      respondHTTP(client, code, "OK", String(TUNABLES[params.tunable].name) + "=" + params.value, "");
+    } else {
+      code = 400;
+      respondHTTP(client, code, "Bad Request", "Unknown tunable, or value out of bounds", "");
+    }
+#ifdef FLEET_GATEWAY
+  } else if (req == FLEET) {
+    code = 200;
+    BufferedPrint out(client);  // flushed when it goes out of scope
+    respondHTTPHeaders(out, code, "OK", "text/plain", "");
+    writeFleetSnapshot(out);
+  } else if (req == FLEET_LOCK || req == FLEET_UNLOCK) {
+    code = 200;
+    respondHTTP(client, code, "OK", "Sent to " + String(fleetGateway.lastFanOut) + " peers", "");
+#endif
   } else {
     // This is the case where we attempt to lock/unlock but for whatever reason
     // this request cannot be processed (e.g. FSM is in BUSY_WAIT)
-    respondHTTP(client, 503, "Service Unavailable", stateToString(st), "");
+    code = 503;
+    respondHTTP(client, code, "Service Unavailable", stateToString(st), "");
   }
+  metricsRecordRequest(req, code);
 
   client.stop();
   Serial.println("client disconnected");
 }
 
+/**
+ * This function reads commands typed into the serial console without blocking, one line at a time, and runs
+ * them. Supported commands:
+ *  - mem : prints the stack high-water mark and heap usage
+ *
+ * Input: None
+ * Output: None
+ *
+ * Side effects: consumes the available serial input and prints the result of any complete command.
+ */
+void handleSerialCommands() {
+  static char line[32];
+  static size_t len = 0;
+
+  while (Serial.available()) {
+    char c = Serial.read();
+    if (c == '\r') continue;
+    if (c != '\n') {
+      if (len < sizeof(line) - 1) line[len++] = c;
+      continue;
+    }
+
+    line[len] = '\0';
+    len = 0;
+    if (strcmp(line, "mem") == 0) {
+      updateMemoryStats();
+      printMemoryStats(Serial);
+    } else if (line[0] != '\0') {
+      Serial.print("Unknown command: ");
+      Serial.println(line);
+    }
+  }
+}
+
+/**
+ * This function brings up the LED matrix, the WiFi connection and the servo calibration concurrently instead of
+ * one after another. Each stage is a small state machine that is advanced in turn until all of them are done:
+ *  - the LED matrix shows "OK" for 2 seconds as a self test
+ *  - WiFi connection attempts are made every 2 seconds until one succeeds
+ *  - the servo is calibrated with `calibrationStep()`, which only needs the CPU between motor moves
+ *
+ * `WiFi.begin()` blocks while it associates, but the servo keeps moving in the meantime, so the calibration
+ * steps only get longer, never wrong.
+ *
+ * Input: None
+ * Output: None
+ *
+ * Side effects: connects to WiFi (updating `status`), calibrates the servos of all doors and records the duration of each
+ * stage (since reset) in `metrics`.
+ */
+void runBootPipeline() {
+  unsigned long bootStart = millis();
+
+  // Stage 1: LED matrix test
+  matrix.begin();
+  ledPlayerBegin();
+  Serial.println("Testing LED Matrix - displaying test text");
+  displayFrame(BOOT_FRAME);
+  bool matrixDone = false;
+
+  // Stage 2: WiFi
+  Serial.println(SECRET_SSID);
+#ifdef SECRET_PASS
+  Serial.println(SECRET_PASS);
+#endif
+
+  // check for the WiFi module:
+  if (WiFi.status() == WL_NO_MODULE) {
+    Serial.println("Communication with WiFi module failed!");
+    while (true);
+  }
+
+  String fv = WiFi.firmwareVersion();
+  if (fv < WIFI_FIRMWARE_LATEST_VERSION) {
+    Serial.println("Please upgrade the firmware");
+  }
+  bool wifiDone = false;
+  int wifiAttempts = 0;
+  unsigned long lastWifiAttempt = 0;
+  applyWifiCache(ssid);
+
+  // Stage 3: servo self-calibration, of all doors at once
+  for (Door& door : doors) {
+    door.servo.beginCalibration(MIN_UNLOCK_ANGLE, MAX_LOCK_ANGLE);
+  }
+  bool calibrationDone = false;
+
+  while (!matrixDone || !wifiDone || !calibrationDone) {
+    if (!matrixDone && millis() - bootStart >= 2000) {  // Show test pattern for 2 seconds
+      matrixDone = true;
+      Serial.println("LED Matrix test complete");
+    }
+
+    if (!wifiDone && (wifiAttempts == 0 || millis() - lastWifiAttempt >= 2000)) {
+      if (wifiCacheUsed && wifiAttempts == WIFI_CACHE_MAX_ATTEMPTS) {
+        // The lease is probably stale; this attempt and the next boot go through DHCP
+        clearWifiCache();
+      }
+
+      // attempt to connect to WiFi network:
+      Serial.print("Attempting to connect to Network named: ");
+      Serial.println(ssid);
+      wifiAttempts++;
+      lastWifiAttempt = millis();
+#ifdef SECRET_PASS
+      status = WiFi.begin(ssid, pass);
+#else
+      status = WiFi.begin(ssid);
+#endif
+      Serial.print("WiFi.begin() took ");
+      Serial.print(millis() - lastWifiAttempt);
+      Serial.println(wifiCacheUsed ? " ms with the cached lease" : " ms with DHCP");
+
+      if (status == WL_CONNECTED && wifiCacheUsed && !wifiCacheLeaseWorks()) {
+        // Associated, but the address is not ours any more; join again through DHCP
+        clearWifiCache();
+        WiFi.disconnect();
+        status = WL_DISCONNECTED;
+      }
+      if (status == WL_CONNECTED) {
+        wifiDone = true;
+        metrics.bootWifiMs = millis();
+        Serial.print("WiFi connected after ");
+        Serial.print(metrics.bootWifiMs);
+        Serial.println(" ms");
+        // A connection made with the cached lease has nothing new to store
+        if (!wifiCacheUsed) saveWifiCache(ssid);
+      }
+    }
+
+    if (!calibrationDone) {
+      bool allCalibrated = true;
+      for (Door& door : doors) {
+        allCalibrated &= door.servo.calibrationStep();
+      }
+      if (allCalibrated) {
+        calibrationDone = true;
+        metrics.bootCalibrationMs = millis();
+        Serial.print("Calibration done after ");
+        Serial.print(metrics.bootCalibrationMs);
+        Serial.println(" ms");
+      }
+    }
+
+    delay(10);
+  }
+}
+
 // Include test files if testing is enabled
 #ifdef UNIT_TEST
 #include "doorlock_unit_tests.h"
@@ -762,6 +1573,9 @@ void respondRequest(WiFiClient& client, Request req, State st) {
  * 
  */
 void setup() {
+  paintStack();
+  metrics.resetCause = readResetCause();
+
   Serial.begin(9600);
   while (!Serial);
 
@@ -771,6 +1585,10 @@ void setup() {
 
   // Initialize EEPROM for authentication
   EEPROM.put(EEPROM_TIMESTAMP_ADDR, 0);
+  tunablesBegin(false);
+  authKeyContext();
+  journalBegin();
+  scheduleBegin();
 
   // WiFi setup for HTTP testing
   Serial.println("Setting up WiFi for integration tests...");
@@ -842,59 +1660,35 @@ void setup() {
   EEPROM.put(EEPROM_TIMESTAMP_ADDR, 0);
 #endif
 
-  // Initialize Arduino LED Matrix FIRST to test it
-  matrix.begin();
-  Serial.println("Testing LED Matrix - displaying test text");
-  displayText("OK");
-  delay(2000);  // Show test pattern for 2 seconds
-  Serial.println("LED Matrix test complete");
-
-  // WiFi setup
-  Serial.println(SECRET_SSID);
-#ifdef SECRET_PASS
-  Serial.println(SECRET_PASS);
-#endif
-
-  // check for the WiFi module:
-  if (WiFi.status() == WL_NO_MODULE) {
-    Serial.println("Communication with WiFi module failed!");
-    while (true);
-  }
-
-  String fv = WiFi.firmwareVersion();
-  if (fv < WIFI_FIRMWARE_LATEST_VERSION) {
-    Serial.println("Please upgrade the firmware");
-  }
-
-  // attempt to connect to WiFi network:
-  while (status != WL_CONNECTED) {
-    Serial.print("Attempting to connect to Network named: ");
-    Serial.println(ssid);
-#ifdef SECRET_PASS
-    status = WiFi.begin(ssid, pass);
-#else
-    status = WiFi.begin(ssid);
-#endif
-    delay(2000);
-  }
-  server.begin();
-  printWifiStatus();
+  // Load the tunables before anything reads them
+  tunablesBegin();
+  // Work out the HMAC key context now rather than on the first request
+  authKeyContext();
 
   // Hardware setup
   pinMode(calibrateBtnPin, INPUT_PULLUP);
-  attachInterrupt(digitalPinToInterrupt(calibrateBtnPin), calibrateBtnIsr, FALLING);
+  buttonBegin(calibrateBtn, calibrateBtnPin);
+  attachInterrupt(digitalPinToInterrupt(calibrateBtnPin), calibrateBtnIsr, CHANGE);
+  initDoors();
 
-  // Servo self-calibration and initialization 
-  myservo.init();
-  myservo.calibrate(MIN_UNLOCK_ANGLE, MAX_LOCK_ANGLE);
-  Serial.print("minFeedback: ");
-  Serial.println(myservo.minFeedback);
-  Serial.print("maxFeedback: ");
-  Serial.println(myservo.maxFeedback);
-  Serial.print("minPoFeedback: ");
-  Serial.println(myservo.minPoFeedback);
-  Serial.print("maxPoFeedback: ");
-  Serial.println(myservo.maxPoFeedback);
+  // LED matrix test, WiFi and servo calibration all run at the same time
+  runBootPipeline();
+  server.begin();
+  printWifiStatus();
+  requestTimingBegin();
+
+  for (int i = 0; i < NUM_DOORS; i++) {
+    Serial.print("Door ");
+    Serial.println(i);
+    Serial.print("minFeedback: ");
+    Serial.println(doors[i].servo.minFeedback);
+    Serial.print("maxFeedback: ");
+    Serial.println(doors[i].servo.maxFeedback);
+    Serial.print("minPoFeedback: ");
+    Serial.println(doors[i].servo.minPoFeedback);
+    Serial.print("maxPoFeedback: ");
+    Serial.println(doors[i].servo.maxPoFeedback);
+  }
 
   // Initialize EEPROM (virtualEEPROM for Uno R4)
   // No explicit begin() needed for Uno R4
@@ -903,12 +1697,30 @@ void setup() {
   Serial.print("Stored timestamp: ");
   Serial.println(storedTimestamp);
 
-  // Initialize FSM state
-  fsmState.currentState = CALIBRATE_LOCK;
-  fsmState.lockDeg = MAX_LOCK_ANGLE;
-  fsmState.unlockDeg = MIN_UNLOCK_ANGLE;
-  fsmState.startTime = 0;
-  fsmState.curCmd = NONE;
+  Serial.print("Reset cause: ");
+  Serial.println(resetCauseToString(metrics.resetCause));
+
+  // Resume the event journal where the previous boot left it
+  journalBegin();
+  journalAppend(JOURNAL_BOOT, metrics.resetCause, 0);
+  // Persist the FSM inputs that led to a watchdog reset, then record anew
+  replayBegin(metrics.resetCause);
+  // Rearm the scheduled commands, on the journal's clock
+  scheduleBegin();
+
+#ifdef PROFILE_LOOP
+  profilerBegin();
+  Serial.println("Loop profiling enabled");
+#endif
+
+  // Initialize FSM state of every door
+  for (Door& door : doors) {
+    door.fsm.currentState = CALIBRATE_LOCK;
+    door.fsm.lockDeg = MAX_LOCK_ANGLE;
+    door.fsm.unlockDeg = MIN_UNLOCK_ANGLE;
+    door.fsm.startTime = 0;
+    door.fsm.curCmd = NONE;
+  }
 
   Serial.println("FSM initialized in CALIBRATE_LOCK state");
 
@@ -918,7 +1730,15 @@ void setup() {
   Serial.print("FSM ready - now in ");
   Serial.println(stateToString(fsmState.currentState));
 
-  WDT.begin(wdtInterval);
+  watchdogBegin(metrics.resetCause);
+  for (int i = 0; i < NUM_DOORS; i++) {
+    watchdogState(i, doors[i].fsm.currentState);
+  }
+
+  metrics.bootMs = millis();
+  Serial.print("Ready to serve requests ");
+  Serial.print(metrics.bootMs);
+  Serial.println(" ms after reset");
 #endif
 }
 
@@ -934,38 +1754,120 @@ void setup() {
  */
 void loop() {
 #ifndef TESTING
-  // Parse HTTP request (if any) and obtain the corresponding command.
-  WiFiClient client = server.available();
+  unsigned long loopStart = millis();
+
+  // Parse HTTP request (if any) and obtain the corresponding command. Commands are taken ahead of reads.
+  watchdogPhase(PHASE_ACCEPT);
+  PROFILE_BEGIN(PHASE_ACCEPT);
+  admissionPoll(server);
+  String requestLine;
+  unsigned long acceptedMs = 0;
+  WiFiClient client = admissionNext(requestLine, acceptedMs);
+  PROFILE_END(PHASE_ACCEPT);
   if (client) {
     Serial.println("Has client available!");
   }
-  Request req = getTopRequest(client);
+  watchdogPhase(PHASE_PARSE);
+  PROFILE_BEGIN(PHASE_PARSE);
+  if (client) {
+    requestTimingNext();
+  }
+  unsigned long parseStart = micros();
+  RequestParams params;
+  Request req = getTopRequest(client, params, requestLine, acceptedMs);
+  requestTiming.parseUs = micros() - parseStart;
+  PROFILE_END(PHASE_PARSE);
+  if (req != EMPTY) {
+    watchdogRequest(req);
+  }
   Command cmd = requestToCommand(req);
+#ifdef FLEET_GATEWAY
+  if (req == FLEET_LOCK || req == FLEET_UNLOCK) {
+    fleetFanOut(cmd);
+  }
+#endif
 
-  // Get current servo position
-  int currentDeg = myservo.deg();
+  // Take the oldest button press, if any; presses queued after it are given to the FSM in later iterations
+  unsigned long btnPressMs = 0;
+  bool btnPressed = eventNextButtonPress(btnPressMs);
 
-  bool btnPressed = false;
-  noInterrupts();
-  if (calibrateBtnPressed) {
-    btnPressed = true; 
-    calibrateBtnPressed = false;
-  }
-  interrupts();
+  // Hand the scheduled commands that are due to their doors
+  scheduleTick();
 
-  // Run FSM transition
-  fsmTransition(currentDeg, millis(), btnPressed, cmd);
+  // Read the positions of and advance the FSMs of the doors that are due
+  tickDoors(req == EMPTY ? -1 : params.door, cmd, btnPressed, btnPressMs);
+  scheduleRequest(req, params);
+  for (int i = 0; i < NUM_DOORS; i++) {
+    watchdogState(i, doors[i].fsm.currentState);
+  }
 
   // Respond to request, if any
-  respondRequest(client, req, fsmState.currentState);
+  watchdogPhase(PHASE_RESPOND);
+  PROFILE_BEGIN(PHASE_RESPOND);
+  unsigned long writeStart = micros();
+  respondRequest(client, req, doors[params.door].fsm.currentState, params);
+  if (req != EMPTY) {
+    metrics.writeUs.observe(micros() - writeStart);
+  }
+
+  // Answer the reads that queued up meanwhile from the door states computed above, without ticking the doors
+  // again, so that a burst of status polls is cleared quickly and cannot hold up the next command. The reads
+  // left when DRAIN_BUDGET_MS is up wait for the next iterations, and no read may wait for its headers past it.
+  unsigned long drainStart = millis();
+  while (admissionHasRead() && millis() - drainStart < DRAIN_BUDGET_MS) {
+    String readLine;
+    unsigned long readAcceptedMs = 0;
+    WiFiClient readClient = admissionNext(readLine, readAcceptedMs, true);
+    unsigned long now = millis();
+    unsigned long drainLeft = DRAIN_BUDGET_MS - min(now - drainStart, DRAIN_BUDGET_MS);
+    unsigned long readTimeout = min(ADMISSION_TIMEOUT, now - readAcceptedMs + drainLeft);
+    // Timed like the request above; the doors are not ticked, so fsm stays at 0
+    requestTimingNext();
+    unsigned long readParseStart = micros();
+    RequestParams readParams;
+    Request readReq = getTopRequest(readClient, readParams, readLine, readAcceptedMs, readTimeout);
+    requestTiming.parseUs = micros() - readParseStart;
+    if (readReq == EMPTY) continue;
+    watchdogRequest(readReq);
+    unsigned long readWriteStart = micros();
+    respondRequest(readClient, readReq, doors[readParams.door].fsm.currentState, readParams);
+    metrics.writeUs.observe(micros() - readWriteStart);
+  }
+  PROFILE_END(PHASE_RESPOND);
 
   // Update LED matrix display
+  watchdogPhase(PHASE_DISPLAY);
+  PROFILE_BEGIN(PHASE_DISPLAY);
   updateMatrixDisplay();
+  updateMoveProgress(doors[displayedDoor()]);
+  PROFILE_END(PHASE_DISPLAY);
+
+  // Keep the WiFi link up
+  watchdogPhase(PHASE_WIFI);
+  PROFILE_BEGIN(PHASE_WIFI);
+  wifiLinkPoll();
+  fleetPoll();
+  mqttPoll();
+  PROFILE_END(PHASE_WIFI);
+
+  // Serial console commands and memory usage
+  handleSerialCommands();
+  memoryStatsPoll();
+
+  // Persist the FSM input recording, a few records at a time, after a door went to BAD
+  replayPersistStep();
 
   // Pet watchdog
-  WDT.refresh();
+  watchdogPhase(PHASE_WATCHDOG);
+  PROFILE_BEGIN(PHASE_WATCHDOG);
+  watchdogRefresh();
+  PROFILE_END(PHASE_WATCHDOG);
+
+  metrics.loopMs.observe(millis() - loopStart);
+  admissionLoopTime(millis() - loopStart);
 
-  // Small delay
-  delay(100);
+  // Small delay, cut short by a button event so that it is handled while the lock is still where it was
+  // pressed
+  eventWait(LOOP_DELAY);
 #endif
 }
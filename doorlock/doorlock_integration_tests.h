@@ -38,20 +38,27 @@ String generateHMACSignature(const String& nonce, const char* password) {
   return bytesToHex(hmac, 32);
 }
 
-// Helper function that unifies the sequence to process a server request
+// Helper function that unifies the sequence to process a server request. Connections go through
+// admission like in loop(), so the next request served is the oldest command, if any.
 void processServerRequest() {
-  WiFiClient client = server.available();
-  Request req = getTopRequest(client);
+  admissionPoll(server);
+  String requestLine;
+  unsigned long acceptedMs = 0;
+  WiFiClient client = admissionNext(requestLine, acceptedMs);
+  RequestParams params;
+  Request req = getTopRequest(client, params, requestLine, acceptedMs);
   Command cmd = requestToCommand(req);
+  Door& door = doors[params.door];
 
   // Get current servo position
-  int currentDeg = myservo.deg();
+  int currentDeg = door.servo.deg();
 
   // Run FSM transition
-  fsmTransition(currentDeg, millis(), false, cmd);
+  fsmTransition(door, currentDeg, millis(), false, cmd);
+  scheduleRequest(req, params);
 
   // Respond to request, if any
-  respondRequest(client, req, fsmState.currentState);
+  respondRequest(client, req, door.fsm.currentState, params);
 }
 
 // Fetch-like function for Arduino (simplified HTTP client)
@@ -109,9 +116,11 @@ HTTPTestResult fetch(const String& path, const String& method = "GET", const Str
   // Wait for response (with timeout)
   // In real client: fetch() handles this automatically
   unsigned long timeout = millis() + 5000;  // 5 second timeout
-  int waitCount = 0;
-  processServerRequest();
-  delay(1000);
+  // Admission may need a few polls before the request line is in
+  while (!client.available() && millis() < timeout) {
+    processServerRequest();
+    delay(10);
+  }
 
   if (!client.available()) {
     result.message = "Timeout waiting for response";
@@ -222,6 +231,31 @@ HTTPTestResult sendUnlockCommand(const char* password) {
   return fetch("/unlock", "POST", auth.nonce, auth.signature);
 }
 
+// Request with a fresh nonce signed with TEST_PASSWORD
+HTTPTestResult fetchAuthed(const String& path, const String& method = "GET") {
+  AuthHeaders auth = generateAuth(TEST_PASSWORD);
+  return fetch(path, method, auth.nonce, auth.signature);
+}
+
+// Prints the banner that starts an integration test
+void beginIntegrationTest(const char* title) {
+  Serial.println("\n========================================");
+  Serial.println(title);
+  Serial.println("========================================");
+}
+
+// Prints the outcome of an integration test, described by `what` if it passed, and returns it
+bool endIntegrationTest(bool passed, const char* what) {
+  Serial.println("\n--- Test Results ---");
+  if (passed) {
+    Serial.print("✓ TEST PASSED - ");
+    Serial.println(what);
+  } else {
+    Serial.println("✗ TEST FAILED");
+  }
+  return passed;
+}
+
 // OPTIONS request (CORS preflight)
 bool sendOPTIONSRequest(const String& path) {
   HTTPTestResult result = fetch(path, "OPTIONS");
@@ -809,6 +843,354 @@ bool testTimeoutToBad() {
   return testPassed;
 }
 
+/*
+ * INTEGRATION TEST 9: HTTP Metrics Endpoint Test
+ * Action: Test GET /metrics endpoint with and without authentication
+ * Expected: Authenticated request returns the metrics in Prometheus text format,
+ * unauthenticated request returns 403
+ */
+bool testHTTPMetricsEndpoint() {
+  beginIntegrationTest("INTEGRATION TEST 9: HTTP Metrics Endpoint");
+
+  HTTPTestResult result = fetchAuthed("/metrics");
+  bool hasMetrics = (result.statusCode == 200 &&
+                     result.responseBody.indexOf("doorlock_http_requests_total") >= 0 &&
+                     result.responseBody.indexOf("doorlock_uptime_seconds") >= 0);
+
+  HTTPTestResult unauthResult = fetch("/metrics", "GET");
+  bool rejected = (unauthResult.statusCode == 403);
+
+  Serial.print("Authenticated status code: ");
+  Serial.println(result.statusCode);
+  Serial.print("Unauthenticated status code: ");
+  Serial.println(unauthResult.statusCode);
+
+  bool testPassed = hasMetrics && rejected;
+  return endIntegrationTest(testPassed, "Metrics endpoint working correctly");
+}
+
+/*
+ * INTEGRATION TEST 10: Per-Door Routes Test
+ * Action: Test GET /doors/{id}/status for the first door and for a door that
+ * does not exist
+ * Expected: /doors/0/status returns the same state as /status, and a door id
+ * out of range returns 403
+ */
+bool testHTTPDoorRoutes() {
+  beginIntegrationTest("INTEGRATION TEST 10: Per-Door Routes");
+
+  HTTPTestResult statusResult = getStatus(TEST_PASSWORD);
+  HTTPTestResult doorResult = fetchAuthed("/doors/0/status");
+  bool sameState = (doorResult.statusCode == 200 &&
+                    doorResult.responseBody == statusResult.responseBody);
+
+  HTTPTestResult missingResult = fetchAuthed("/doors/" + String(NUM_DOORS) + "/status");
+  bool rejected = (missingResult.statusCode == 403);
+
+  Serial.print("/doors/0/status: ");
+  Serial.print(doorResult.statusCode);
+  Serial.print(" ");
+  Serial.println(doorResult.responseBody);
+  Serial.print("Missing door status code: ");
+  Serial.println(missingResult.statusCode);
+
+  bool testPassed = sameState && rejected;
+  return endIntegrationTest(testPassed, "Per-door routes working correctly");
+}
+
+#ifdef MQTT_BROKER
+/*
+ * INTEGRATION TEST 11: MQTT State Publishing and Command Authentication
+ * Action: With a broker running at MQTT_BROKER (e.g. mosquitto on the
+ * development machine), subscribe to the state topic of the first door with a
+ * second client, make the FSM change state without moving the motor, then
+ * publish an unsigned command
+ * Expected: The observer receives the new state, and the unsigned command is
+ * not given to the door
+ */
+bool testMQTT() {
+  beginIntegrationTest("INTEGRATION TEST 11: MQTT");
+
+  unsigned long start = millis();
+  while (!mqttClient.connected() && millis() - start < 10000) {
+    mqttPoll();
+    delay(100);
+  }
+
+  WiFiClient observerNet;
+  MqttClient observer(observerNet);
+  observer.setId(MQTT_TOPIC "-test-observer");
+  bool observerConnected = observer.connect(MQTT_BROKER, MQTT_PORT);
+  observer.subscribe(MQTT_TOPIC "/doors/0/state");
+
+  // CALIBRATE_LOCK -> CALIBRATE_UNLOCK only records the position
+  FSMState savedState = fsmState;
+  fsmState.currentState = CALIBRATE_LOCK;
+  fsmTransition(myservo.deg(), millis(), true, NONE);
+
+  // The retained state arrives first, then the new one
+  bool received = false;
+  start = millis();
+  while (!received && millis() - start < 5000) {
+    mqttPoll();
+    if (observer.parseMessage() > 0) {
+      received = (observer.readString() == "CALIBRATE_UNLOCK");
+    }
+    delay(50);
+  }
+
+  observer.beginMessage(MQTT_TOPIC "/doors/0/command");
+  observer.print("lock 1 00");
+  observer.endMessage();
+  start = millis();
+  while (millis() - start < 1000) {
+    mqttPoll();
+    observer.poll();
+    delay(50);
+  }
+  bool rejected = (doors[0].pendingCmd == NONE);
+
+  fsmState = savedState;
+  mqttRecordTransition(doors[0], fsmState.currentState);
+  mqttPoll();
+  observer.stop();
+
+  Serial.print("Observer connected: ");
+  Serial.println(observerConnected);
+  Serial.print("State received: ");
+  Serial.println(received);
+  Serial.print("Unsigned command rejected: ");
+  Serial.println(rejected);
+
+  bool testPassed = observerConnected && received && rejected;
+  return endIntegrationTest(testPassed, "MQTT working correctly");
+}
+#endif
+
+/*
+ * INTEGRATION TEST 12: HTTP Journal Endpoint
+ * Action: Test GET /journal after the earlier tests have locked and unlocked
+ * the door, with and without a time range and without authentication
+ * Expected: The whole journal contains the transitions, a range that ends
+ * before them does not, and the unauthenticated request returns 403
+ */
+bool testHTTPJournalEndpoint() {
+  beginIntegrationTest("INTEGRATION TEST 12: HTTP Journal Endpoint");
+
+  HTTPTestResult result = fetchAuthed("/journal");
+  bool hasEvents = (result.statusCode == 200 &&
+                    result.responseBody.startsWith("time,event,door,detail") &&
+                    result.responseBody.indexOf(",transition,0,") >= 0);
+
+  HTTPTestResult rangeResult = fetchAuthed("/journal?from=0&to=1");
+  bool filtered = (rangeResult.statusCode == 200 &&
+                   rangeResult.responseBody.indexOf(",transition,") < 0);
+
+  HTTPTestResult unauthResult = fetch("/journal", "GET");
+  bool rejected = (unauthResult.statusCode == 403);
+
+  Serial.print("Authenticated status code: ");
+  Serial.println(result.statusCode);
+  Serial.println(result.responseBody);
+  Serial.print("Unauthenticated status code: ");
+  Serial.println(unauthResult.statusCode);
+
+  bool testPassed = hasEvents && filtered && rejected;
+  return endIntegrationTest(testPassed, "Journal endpoint working correctly");
+}
+
+/*
+ * INTEGRATION TEST 13: HTTP History Endpoint
+ * Action: Test GET /history after the earlier tests have locked and unlocked
+ * the door, and without authentication
+ * Expected: The history contains the moves started by the commands and their
+ * arrivals, and the unauthenticated request returns 403
+ */
+bool testHTTPHistoryEndpoint() {
+  beginIntegrationTest("INTEGRATION TEST 13: HTTP History Endpoint");
+
+  HTTPTestResult result = fetchAuthed("/history");
+  bool hasTransitions = (result.statusCode == 200 &&
+                         result.responseBody.startsWith("ms,door,from,to,deg,cmd,cause") &&
+                         result.responseBody.indexOf(",0,LOCK,BUSY_MOVE,") >= 0 &&
+                         result.responseBody.indexOf(",unlock,command") >= 0 &&
+                         result.responseBody.indexOf(",arrived") >= 0);
+
+  HTTPTestResult unauthResult = fetch("/history", "GET");
+  bool rejected = (unauthResult.statusCode == 403);
+
+  Serial.print("Authenticated status code: ");
+  Serial.println(result.statusCode);
+  Serial.println(result.responseBody);
+  Serial.print("Unauthenticated status code: ");
+  Serial.println(unauthResult.statusCode);
+
+  bool testPassed = hasTransitions && rejected;
+  return endIntegrationTest(testPassed, "History endpoint working correctly");
+}
+
+/*
+ * INTEGRATION TEST 14: Scheduled Relock
+ * Action: Send POST /unlock?relock_after=60, list the schedule, then clear it;
+ * also send POST /lock?every=1
+ * Expected: The schedule holds a lock of the first door due within 60
+ * seconds, and is empty once cleared; the period of 1 second is rejected with 400
+ */
+bool testHTTPScheduledRelock() {
+  beginIntegrationTest("INTEGRATION TEST 14: Scheduled Relock");
+
+  HTTPTestResult unlockResult = fetchAuthed("/unlock?relock_after=60", "POST");
+
+  HTTPTestResult scheduleResult = fetchAuthed("/schedule");
+  bool scheduled = (unlockResult.statusCode == 200 && scheduleResult.statusCode == 200 &&
+                    scheduleResult.responseBody.indexOf("0,lock,") >= 0);
+
+  fetchAuthed("/schedule/clear", "POST");
+  HTTPTestResult clearedResult = fetchAuthed("/schedule");
+  bool cleared = (clearedResult.statusCode == 200 &&
+                  clearedResult.responseBody.indexOf("0,lock,") < 0);
+
+  HTTPTestResult tooOftenResult = fetchAuthed("/lock?every=1", "POST");
+  bool rejected = (tooOftenResult.statusCode == 400);
+
+  Serial.print("Unlock status code: ");
+  Serial.println(unlockResult.statusCode);
+  Serial.println(scheduleResult.responseBody);
+
+  bool testPassed = scheduled && cleared && rejected;
+  return endIntegrationTest(testPassed, "Scheduled relock working correctly");
+}
+
+/*
+ * INTEGRATION TEST 15: HTTP Full Status Endpoint
+ * Action: Test GET /status/full and GET /doors/0/status/full, and
+ * GET /status/full without authentication
+ * Expected: Both return the first door's state, positions and calibration as
+ * JSON, and the unauthenticated request returns 403
+ */
+bool testHTTPFullStatusEndpoint() {
+  beginIntegrationTest("INTEGRATION TEST 15: HTTP Full Status Endpoint");
+
+  String expectedState = String("\"state\":\"") + stateToString(fsmState.currentState) + "\"";
+  HTTPTestResult result = fetchAuthed("/status/full");
+  bool hasStatus = (result.statusCode == 200 && result.responseBody.startsWith("{\"door\":0,") &&
+                    result.responseBody.indexOf(expectedState) >= 0 &&
+                    result.responseBody.indexOf("\"calibration\":{\"min_deg\":") >= 0 &&
+                    result.responseBody.indexOf("\"last_move_ms\":") >= 0);
+
+  HTTPTestResult doorResult = fetchAuthed("/doors/0/status/full");
+  bool hasDoorStatus = (doorResult.statusCode == 200 &&
+                        doorResult.responseBody.indexOf(expectedState) >= 0);
+
+  HTTPTestResult unauthResult = fetch("/status/full", "GET");
+  bool rejected = (unauthResult.statusCode == 403);
+
+  Serial.print("Unauthenticated status code: ");
+  Serial.println(unauthResult.statusCode);
+
+  bool testPassed = hasStatus && hasDoorStatus && rejected;
+  return endIntegrationTest(testPassed, "Full status endpoint working correctly");
+}
+
+/*
+ * INTEGRATION TEST 16: Runtime Tunables
+ * Action: List the tunables, set the move timeout to its current value, then
+ * try a value out of its bounds and a tunable that does not exist
+ * Expected: The list holds the move timeout at its default, the valid value is
+ * accepted and the other two are rejected with 400
+ */
+bool testHTTPTunables() {
+  beginIntegrationTest("INTEGRATION TEST 16: Runtime Tunables");
+
+  String expected = String("move_timeout_ms,") + TOL + ",";
+  HTTPTestResult listResult = fetchAuthed("/tunables");
+  bool listed = (listResult.statusCode == 200 &&
+                 listResult.responseBody.startsWith("name,value,min,max,default,at_boot") &&
+                 listResult.responseBody.indexOf(expected) >= 0);
+
+  HTTPTestResult setResult = fetchAuthed("/tunables/move_timeout_ms?value=" + String(TOL), "POST");
+  HTTPTestResult boundsResult = fetchAuthed("/tunables/move_timeout_ms?value=1", "POST");
+  HTTPTestResult unknownResult = fetchAuthed("/tunables/no_such_tunable?value=1", "POST");
+  bool validated = (setResult.statusCode == 200 && boundsResult.statusCode == 400 &&
+                    unknownResult.statusCode == 400 && TOL == 5000);
+
+  Serial.println(listResult.responseBody);
+  Serial.print("Set/out of bounds/unknown status codes: ");
+  Serial.print(setResult.statusCode);
+  Serial.print("/");
+  Serial.print(boundsResult.statusCode);
+  Serial.print("/");
+  Serial.println(unknownResult.statusCode);
+
+  bool testPassed = listed && validated;
+  return endIntegrationTest(testPassed, "Tunables working correctly");
+}
+
+/*
+ * INTEGRATION TEST 17: Commands Before Queued Reads
+ * Action: Queue status polls (fewer than would be shed), then an unauthenticated
+ * POST /lock, and serve a single request
+ * Expected: The POST is answered (with 403) while the polls are still waiting,
+ * and counted as served ahead of them
+ */
+bool testHTTPCommandPriority() {
+  beginIntegrationTest("INTEGRATION TEST 17: Commands Before Queued Reads");
+
+  const int NUM_READS = OVERLOAD_READS - 1;
+  WiFiClient clients[NUM_READS + 1];  // the reads, then the command
+  IPAddress serverIP = WiFi.localIP();
+  bool connected = true;
+  for (int i = 0; i <= NUM_READS; i++) {
+    connected &= (bool)clients[i].connect(serverIP, 80);
+    clients[i].print(i < NUM_READS ? "GET /status" : "POST /lock");
+    clients[i].print(" HTTP/1.1\r\nConnection: close\r\n\r\n");
+    clients[i].flush();
+    // Accept each connection before the next one, so that they queue in this order
+    delay(50);
+    admissionPoll(server);
+  }
+
+  // Wait until every request line is in
+  unsigned long start = millis();
+  bool queued = false;
+  while (!queued && millis() - start < 2000) {
+    admissionPoll(server);
+    queued = (admission.size == NUM_READS + 1);
+    for (int i = 0; i < admission.size; i++) {
+      queued &= (admission.slots[i].cls != ADMISSION_READING);
+    }
+    delay(10);
+  }
+
+  unsigned long commandsFirst = admission.commandsFirst;
+  processServerRequest();
+  delay(500);
+
+  String commandStatus = clients[NUM_READS].readStringUntil('\n');
+  bool readsWaiting = true;
+  for (int i = 0; i < NUM_READS; i++) {
+    readsWaiting &= (clients[i].available() == 0);
+  }
+  bool commandFirst = (commandStatus.startsWith("HTTP/1.1 403") && readsWaiting &&
+                       admission.commandsFirst == commandsFirst + 1);
+
+  // Serve the polls too, so that they do not linger into the next test
+  for (int i = 0; i < NUM_READS; i++) {
+    processServerRequest();
+  }
+  for (WiFiClient& client : clients) {
+    client.stop();
+  }
+
+  Serial.print("Command response: ");
+  Serial.println(commandStatus);
+  Serial.print("Reads still waiting: ");
+  Serial.println(readsWaiting ? "yes" : "no");
+
+  bool testPassed = connected && queued && commandFirst;
+  return endIntegrationTest(testPassed, "Command served before queued reads");
+}
+
 /*
  * Run all integration tests
  * Returns true if all tests pass, false otherwise
@@ -853,6 +1235,35 @@ bool runIntegrationTests() {
   delay(1000);
 
   allPassed &= testTimeoutToBad();
+  delay(1000);
+
+  allPassed &= testHTTPMetricsEndpoint();
+  delay(1000);
+
+  allPassed &= testHTTPDoorRoutes();
+  delay(1000);
+
+#ifdef MQTT_BROKER
+  allPassed &= testMQTT();
+  delay(1000);
+#endif
+
+  allPassed &= testHTTPJournalEndpoint();
+  delay(1000);
+
+  allPassed &= testHTTPHistoryEndpoint();
+  delay(1000);
+
+  allPassed &= testHTTPScheduledRelock();
+  delay(1000);
+
+  allPassed &= testHTTPFullStatusEndpoint();
+  delay(1000);
+
+  allPassed &= testHTTPTunables();
+  delay(1000);
+
+  allPassed &= testHTTPCommandPriority();
 
   Serial.println("\n========================================");
   Serial.println("INTEGRATION TEST SUMMARY");
@@ -263,6 +263,78 @@ const state_inputs testInputs[20] = {
 
 const int numUnitTests = 20;
 
+/*
+ * Replays the FSM input recording stored in the EEPROM (see replay.h), if any,
+ * through fsmTransition() and checks that every door goes through the same
+ * states as when it was recorded. Flash this build onto the board that
+ * misbehaved to reproduce what led to BAD or to a watchdog reset.
+ * Returns true if there is no recording or the replay matches it
+ */
+bool replayStoredInputs() {
+  ReplayDumpHeader header;
+  if (!replayReadHeader(header)) {
+    Serial.println("No FSM input recording stored");
+    return true;
+  }
+  Serial.print("Replaying ");
+  Serial.print(header.numInputs);
+  Serial.println(header.reason == REPLAY_BAD ? " FSM inputs recorded up to BAD"
+                                             : " FSM inputs recorded up to a watchdog reset");
+
+  FSMState savedStates[NUM_DOORS];
+  bool started[NUM_DOORS] = {};
+  for (int d = 0; d < NUM_DOORS; d++) {
+    savedStates[d] = doors[d].fsm;
+  }
+  // Decide with the tunables the recording was made with
+  unsigned long savedTol = TOL;
+  int savedAngleTolerance = ANGLE_TOLERANCE;
+  TOL = header.moveTimeoutMs;
+  ANGLE_TOLERANCE = header.angleTolerance;
+
+  char sToPrint[200];
+  bool matched = true;
+  for (int i = 0; i < header.numInputs && matched; i++) {
+    ReplayInput input;
+    EEPROM.get(replayInputAddr(i), input);
+    int d = input.doorState >> 4;
+    State recorded = (State)(input.doorState & 0xF);
+    FSMState& fsm = doors[d].fsm;
+    if (!started[d]) {
+      // When a move started and for which command are not recorded, so each
+      // door starts at its first input outside BUSY_MOVE
+      if (recorded == BUSY_MOVE) continue;
+      fsm = FSMState{recorded, header.doors[d].lockDeg, header.doors[d].unlockDeg, 0, NONE};
+      started[d] = true;
+    } else if (fsm.currentState != recorded) {
+      sprintf(sToPrint, "Input %d (door %d): recorded in %s, replayed in %s", i, d,
+              unitTestStateToString(recorded), unitTestStateToString(fsm.currentState));
+      Serial.println(sToPrint);
+      matched = false;
+      break;
+    }
+    fsmTransition(doors[d], input.deg, input.ms, input.flags & REPLAY_BUTTON,
+                  (Command)(input.flags & ~REPLAY_BUTTON));
+  }
+  for (int d = 0; d < NUM_DOORS && matched; d++) {
+    if (started[d] && doors[d].fsm.currentState != header.doors[d].state) {
+      sprintf(sToPrint, "Door %d: recording ended in %s, replay in %s", d,
+              unitTestStateToString((State)header.doors[d].state),
+              unitTestStateToString(doors[d].fsm.currentState));
+      Serial.println(sToPrint);
+      matched = false;
+    }
+  }
+
+  for (int d = 0; d < NUM_DOORS; d++) {
+    doors[d].fsm = savedStates[d];
+  }
+  TOL = savedTol;
+  ANGLE_TOLERANCE = savedAngleTolerance;
+  Serial.println(matched ? "Replay matches the recording" : "Replay DIVERGED from the recording");
+  return matched;
+}
+
 /*
  * Runs through all the test cases defined above
  * Returns true if all tests pass, false otherwise
@@ -292,6 +364,16 @@ bool runUnitTests() {
   Serial.println("========================================");
   Serial.println("All tests passed!");
   Serial.println("========================================");
+
+  Serial.println();
+  if (!replayStoredInputs()) {
+    return false;
+  }
+
+  // The verbose failure output above uses large stack buffers, so check how
+  // close the tests came to running out of stack.
+  updateMemoryStats();
+  printMemoryStats(Serial);
   return true;
 }
 
@@ -0,0 +1,203 @@
+/*
+ * ISR EVENT QUEUE
+ *
+ * A lock-free single-producer/single-consumer queue that carries timestamped
+ * events from interrupt handlers to loop(). The producers are interrupts of
+ * one priority, which cannot preempt one another, so together they are the
+ * only writer of `head`, and loop() is the only writer of `tail`; neither side
+ * ever needs to disable interrupts, and a memory barrier orders the event's
+ * contents before the index that publishes it. Events are consumed in the order they happened,
+ * and none are lost unless the queue overflows (which is counted).
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <FspTimer.h>
+
+// Capacity of the queue; a power of two that divides 256, so that the free
+// running 8-bit indices stay consistent when they wrap
+const int EVENT_QUEUE_LEN = 16;
+static_assert((EVENT_QUEUE_LEN & (EVENT_QUEUE_LEN - 1)) == 0 && EVENT_QUEUE_LEN <= 256,
+              "EVENT_QUEUE_LEN must be a power of two no larger than 256");
+
+// Edges of a button within this many milliseconds of the previous one are
+// contact bounce; the level is sampled again once it has been stable this long
+const unsigned long BUTTON_DEBOUNCE_MS = 50;
+
+// How often a timer interrupt checks for a button level to sample again
+const float BUTTON_SETTLE_HZ = 100.0f;
+
+// Priority of that timer interrupt; the one attachInterrupt() gives pins, so
+// that it and the pin's ISR never preempt one another while pushing events
+const uint8_t BUTTON_IRQ_PRIORITY = 12;
+
+enum EventType : uint8_t { EVENT_BUTTON_PRESS, EVENT_BUTTON_RELEASE };
+
+struct Event {
+  uint32_t ms;  // millis() when the event happened
+  EventType type;
+};
+
+struct EventQueue {
+  Event events[EVENT_QUEUE_LEN];
+  volatile uint8_t head;  // events pushed; only written by the producer (ISR)
+  volatile uint8_t tail;  // events popped; only written by the consumer (loop())
+  volatile uint32_t dropped;  // events lost because the queue was full
+};
+
+EventQueue eventQueue;
+
+/**
+ * Pushes an event; called from an ISR.
+ *
+ * Input:
+ *  - type (EventType): what happened.
+ *  - ms (unsigned long): when it happened.
+ *
+ * Output: bool indicating whether the event was queued; false if the queue
+ * was full.
+ */
+bool eventPush(EventType type, unsigned long ms) {
+  uint8_t head = eventQueue.head;
+  if ((uint8_t)(head - eventQueue.tail) == EVENT_QUEUE_LEN) {
+    eventQueue.dropped++;
+    return false;
+  }
+  eventQueue.events[head & (EVENT_QUEUE_LEN - 1)] = Event{(uint32_t)ms, type};
+  __sync_synchronize();  // publish the event before the index that covers it
+  eventQueue.head = head + 1;
+  return true;
+}
+
+/**
+ * Pops the oldest event; called from loop().
+ *
+ * Output: bool indicating whether there was an event, in which case it is
+ * stored in `e`.
+ */
+bool eventPop(Event& e) {
+  uint8_t tail = eventQueue.tail;
+  if (tail == eventQueue.head) return false;
+  __sync_synchronize();  // read the event only after seeing the index that covers it
+  e = eventQueue.events[tail & (EVENT_QUEUE_LEN - 1)];
+  __sync_synchronize();  // finish reading before the producer may reuse the slot
+  eventQueue.tail = tail + 1;
+  return true;
+}
+
+inline bool eventPending() { return eventQueue.tail != eventQueue.head; }
+
+/**
+ * Waits up to `ms` milliseconds, returning early as soon as an event is
+ * queued so that it is handled without waiting out the rest of the delay.
+ *
+ * Input:
+ *  - ms (unsigned long): the longest time to wait.
+ *
+ * Output: None
+ */
+void eventWait(unsigned long ms) {
+  unsigned long start = millis();
+  while (millis() - start < ms && !eventPending()) {
+    delay(1);
+  }
+}
+
+// Debounce state of a button, written only by its pin ISR and its settle
+// timer's ISR, which run at the same priority
+struct ButtonDebounce {
+  int pin;
+  FspTimer settleTimer;
+  volatile unsigned long lastEdgeMs;  // time of the last edge, bounce or not
+  volatile bool pressed;              // debounced level
+  volatile bool unsettled;            // an edge was taken for bounce; sample the level again
+};
+
+void buttonSetLevel(ButtonDebounce& button, bool pressed, unsigned long ms) {
+  if (pressed == button.pressed) return;
+  button.pressed = pressed;
+  eventPush(pressed ? EVENT_BUTTON_PRESS : EVENT_BUTTON_RELEASE, ms);
+}
+
+/**
+ * Turns an edge of an active-low button into a press or release event, unless
+ * it is bounce (within BUTTON_DEBOUNCE_MS of the previous edge) or does not
+ * change the debounced level. After bounce, the settle timer samples the
+ * level again, so that the release of a tap shorter than the debounce window
+ * is not lost. Called from the ISR of a pin attached with CHANGE.
+ *
+ * Input:
+ *  - button (ButtonDebounce&): the debounce state of the button.
+ *  - level (int): the level of the pin after the edge.
+ *
+ * Output: None
+ */
+void buttonEdge(ButtonDebounce& button, int level) {
+  unsigned long now = millis();
+  bool bounce = now - button.lastEdgeMs < BUTTON_DEBOUNCE_MS;
+  button.lastEdgeMs = now;
+  button.unsettled = bounce;
+  if (!bounce) buttonSetLevel(button, level == LOW, now);
+}
+
+/**
+ * Timer ISR: samples the level of a button whose last edge was taken for
+ * bounce, once it has been stable for BUTTON_DEBOUNCE_MS, and queues the press
+ * or release it amounts to, timestamped with that last edge.
+ */
+void buttonSettleIsr(timer_callback_args_t* args) {
+  ButtonDebounce& button = *(ButtonDebounce*)args->p_context;
+  if (button.unsettled && millis() - button.lastEdgeMs >= BUTTON_DEBOUNCE_MS) {
+    button.unsettled = false;
+    buttonSetLevel(button, digitalRead(button.pin) == LOW, button.lastEdgeMs);
+  }
+}
+
+/**
+ * Starts the settle timer of the button on `pin`. Must be called before the
+ * pin's interrupt is attached. Without a timer, the button still works, but a
+ * release that ends in bounce is only seen at the next press.
+ *
+ * Input:
+ *  - button (ButtonDebounce&): the debounce state of the button.
+ *  - pin (int): the pin of the button.
+ *
+ * Output: bool indicating whether a timer was available.
+ */
+bool buttonBegin(ButtonDebounce& button, int pin) {
+  button.pin = pin;
+  uint8_t type;
+  int8_t channel = FspTimer::get_available_timer(type);
+  if (channel < 0) {
+    Serial.println("No timer left for button debouncing");
+    return false;
+  }
+  button.settleTimer.begin(TIMER_MODE_PERIODIC, type, channel, BUTTON_SETTLE_HZ, 0.0f,
+                           buttonSettleIsr, &button);
+  button.settleTimer.setup_overflow_irq(BUTTON_IRQ_PRIORITY);
+  button.settleTimer.open();
+  button.settleTimer.start();
+  return true;
+}
+
+/**
+ * Pops events up to and including the oldest button press. Presses that come
+ * after it stay queued for the next loop() iterations, so that each one is
+ * given to the FSM, in order.
+ *
+ * Input:
+ *  - pressMs (unsigned long&): set to the time of the press, if there was one.
+ *
+ * Output: bool indicating whether there was a button press.
+ */
+bool eventNextButtonPress(unsigned long& pressMs) {
+  Event e;
+  while (eventPop(e)) {
+    if (e.type == EVENT_BUTTON_PRESS) {
+      pressMs = e.ms;
+      return true;
+    }
+  }
+  return false;
+}
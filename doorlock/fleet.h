@@ -0,0 +1,480 @@
+/*
+ * FLEET GATEWAY
+ *
+ * Lets one lock act as a gateway for the other locks on the LAN, so that the
+ * app can see and command a whole building with a single request instead of
+ * polling every lock (and paying for HMAC, EEPROM and TCP setup on each).
+ *  - A lock built with FLEET_MEMBER broadcasts a heartbeat over UDP with the
+ *    state of its doors every `FLEET_HEARTBEAT_INTERVAL`, and right away when
+ *    a door changes state. It also accepts signed lock/unlock commands over
+ *    UDP.
+ *  - A lock built with FLEET_GATEWAY keeps a table of the heartbeats it hears
+ *    and serves it with GET /fleet. POST /fleet/lock and POST /fleet/unlock
+ *    command its own doors and send one datagram to every peer, so the fan
+ *    out takes no longer with more peers.
+ *
+ * Datagrams are single lines of text:
+ *   DLHB <device> <ip>:<port> <boot> <seq> <time> <uptime s> <states> <tag>
+ *   DLCMD <lock|unlock> <target> <nonce> <signature>
+ * where <tag> is the first 16 hex digits of the HMAC-SHA256 (keyed with
+ * REMOTE_LOCK_PASS) of everything before it, and <signature> all 64 of them.
+ * In a heartbeat, <device> is the member's ID (its MAC address, in hex),
+ * <ip>:<port> the address it sends from, <time> its Unix time and <states>
+ * the numeric `State` of each of its doors, separated by commas. <boot> is
+ * random per boot of the member, so that the gateway can tell a reboot (which
+ * restarts <seq>) from a replayed heartbeat. <target> is the address of the member the command
+ * is for, and <nonce> is made up by the gateway for every fan out: its Unix
+ * time, a dot and random hex digits; members check it against the last
+ * timestamp they accepted, like an X-Nonce. As the signature covers the
+ * "DLCMD" tag, the action and the target, the X-Nonce and X-Signature of an
+ * HTTP request (or a command for another member) are rejected.
+ *
+ * The gateway keys its table of peers by the signed device ID, and only takes
+ * a heartbeat that comes from the address it is signed for and whose time is
+ * within `REPLAY_WINDOW` of its own clock. A heartbeat replayed from another
+ * address, or after the window, is dropped, so it can neither take the place
+ * of a real peer nor redirect its commands. Commands go back to the signed
+ * address, so several simulated locks can run on one host, each from its own
+ * port (see tools/fleet_sim.py). For example, a lock with one locked door:
+ *   msg="DLHB 0a1b2c3d4e5f 192.168.1.20:5001 7f3a 1 $(date +%s) 60 3"
+ *   tag=$(printf %s "$msg" | openssl dgst -sha256 -hmac "$PASS" -r | cut -c1-16)
+ *   printf '%s %s\n' "$msg" "$tag" | nc -u -w1 -p 5001 <gateway ip> 4210
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiS3.h>
+#include "wifi_link.h"
+
+// Note: doors, NUM_DOORS, State, Command, stateToString(), computeHMAC(),
+// verifyAuthentication(), journalNow(), REPLAY_WINDOW and requestTiming must be
+// defined in doorlock.ino before this header is included.
+
+#if defined(FLEET_MEMBER) || defined(FLEET_GATEWAY)
+
+// UDP port of the fleet protocol, on members and gateways alike
+const uint16_t FLEET_PORT = 4210;
+// Time between two heartbeats when no door changes state (milliseconds)
+const unsigned long FLEET_HEARTBEAT_INTERVAL = 5000;
+// Length of the tag of a heartbeat, in hex digits
+const int FLEET_TAG_LEN = 16;
+// Longest datagram handled; longer ones are dropped
+const int FLEET_MAX_PACKET = 128;
+// Most datagrams handled per call to `fleetPoll()`
+const int FLEET_MAX_PACKETS_PER_POLL = 4;
+
+WiFiUDP fleetUdp;
+bool fleetUdpOpen = false;
+
+/**
+ * Returns the first `len` bytes of `bytes` as lowercase hex.
+ */
+String fleetHex(const unsigned char* bytes, size_t len) {
+  const char* hexDigits = "0123456789abcdef";
+  String hex;
+  for (size_t i = 0; i < len; i++) {
+    hex += hexDigits[bytes[i] >> 4];
+    hex += hexDigits[bytes[i] & 0xF];
+  }
+  return hex;
+}
+
+/**
+ * Returns the tag authenticating `message`: the first `FLEET_TAG_LEN` hex
+ * digits of its HMAC-SHA256.
+ */
+String fleetTag(const String& message) {
+  unsigned char mac[32];
+  computeHMAC(message, REMOTE_LOCK_PASS, mac);
+  return fleetHex(mac, FLEET_TAG_LEN / 2);
+}
+
+/**
+ * Returns the next space-separated token of `line`, starting at `pos`, and
+ * moves `pos` past it. Returns an empty string at the end of the line.
+ */
+String fleetToken(const String& line, int& pos) {
+  while (pos < (int)line.length() && line.charAt(pos) == ' ') pos++;
+  int end = line.indexOf(' ', pos);
+  if (end < 0) end = line.length();
+  String token = line.substring(pos, end);
+  pos = end;
+  return token;
+}
+
+/**
+ * Returns the Unix time heartbeats are stamped with and checked against: the
+ * WiFi module's network time, or the journal's clock while it has none.
+ */
+unsigned long fleetNow() {
+  unsigned long t = WiFi.getTime();
+  return t != 0 ? t : journalNow();
+}
+
+/**
+ * Sends `line` as one datagram.
+ *
+ * Input:
+ *  - ip (IPAddress): where to send it.
+ *  - port (uint16_t): the port to send it to.
+ *  - line (const String&): the datagram, without the trailing newline.
+ *
+ * Output: None
+ */
+void fleetSend(IPAddress ip, uint16_t port, const String& line) {
+  fleetUdp.beginPacket(ip, port);
+  fleetUdp.print(line);
+  fleetUdp.print('\n');
+  fleetUdp.endPacket();
+}
+
+#ifdef FLEET_MEMBER
+
+struct FleetMember {
+  uint32_t seq;
+  unsigned long lastHeartbeatMs;
+  State sentStates[NUM_DOORS];  // door states in the last heartbeat
+};
+
+FleetMember fleetMember;
+
+/**
+ * Broadcasts a heartbeat with the current state of every door to the local
+ * subnet.
+ *
+ * Input:
+ *  - now (unsigned long): the current time, in milliseconds.
+ *
+ * Output: None
+ */
+void fleetSendHeartbeat(unsigned long now) {
+  uint8_t mac[6];
+  WiFi.macAddress(mac);
+  String msg = "DLHB ";
+  msg += fleetHex(mac, sizeof(mac));
+  msg += ' ';
+  msg += WiFi.localIP().toString();
+  msg += ':';
+  msg += FLEET_PORT;
+  msg += ' ';
+  msg += String(requestTiming.bootId, HEX);
+  msg += ' ';
+  msg += ++fleetMember.seq;
+  msg += ' ';
+  msg += fleetNow();
+  msg += ' ';
+  msg += now / 1000;
+  msg += ' ';
+  for (int d = 0; d < NUM_DOORS; d++) {
+    if (d > 0) msg += ',';
+    msg += (int)doors[d].fsm.currentState;
+    fleetMember.sentStates[d] = doors[d].fsm.currentState;
+  }
+  String tag = fleetTag(msg);
+  msg += ' ';
+  msg += tag;
+
+  IPAddress ip = WiFi.localIP();
+  IPAddress mask = WiFi.subnetMask();
+  IPAddress broadcast(ip[0] | (~mask[0] & 0xFF), ip[1] | (~mask[1] & 0xFF),
+                      ip[2] | (~mask[2] & 0xFF), ip[3] | (~mask[3] & 0xFF));
+  fleetSend(broadcast, FLEET_PORT, msg);
+  fleetMember.lastHeartbeatMs = now;
+}
+
+/**
+ * Returns whether any door changed state since the last heartbeat.
+ */
+bool fleetStatesChanged() {
+  for (int d = 0; d < NUM_DOORS; d++) {
+    if (doors[d].fsm.currentState != fleetMember.sentStates[d]) return true;
+  }
+  return false;
+}
+
+/**
+ * Handles a DLCMD datagram: if it is for this lock, and its nonce and the
+ * signature of the whole command pass the same checks as an HTTP request,
+ * every door gets the command on its next tick.
+ *
+ * Input:
+ *  - line (const String&): the datagram.
+ *  - pos (int): index of the first token after "DLCMD".
+ *
+ * Output: None
+ */
+void fleetHandleCommand(const String& line, int pos) {
+  String action = fleetToken(line, pos);
+  String target = fleetToken(line, pos);
+  String nonce = fleetToken(line, pos);
+  String signature = fleetToken(line, pos);
+
+  Command cmd = action == "lock" ? LOCK_CMD : action == "unlock" ? UNLOCK_CMD : NONE;
+  String context = "DLCMD " + action + ' ' + target + ' ';
+  if (cmd == NONE || target != WiFi.localIP().toString() ||
+      !verifyAuthentication(context, nonce, signature)) {
+    Serial.println("Fleet: rejected command");
+    return;
+  }
+  Serial.print("Fleet: received ");
+  Serial.println(action);
+  for (Door& door : doors) {
+    door.pendingCmd = cmd;
+  }
+}
+
+#endif  // FLEET_MEMBER
+
+#ifdef FLEET_GATEWAY
+
+// Most peers the gateway keeps track of; the one heard from least recently is
+// dropped to make room for a new one
+const int MAX_FLEET_PEERS = 16;
+// Most doors reported per peer
+const int MAX_PEER_DOORS = 4;
+// A peer that has not been heard from for this long is reported as stale, and
+// no longer sent commands (milliseconds)
+const unsigned long FLEET_STALE_AFTER = 3 * FLEET_HEARTBEAT_INTERVAL;
+
+struct FleetPeer {
+  bool used;
+  uint64_t device;  // signed device ID
+  IPAddress ip;     // signed address, which its heartbeats come from
+  uint16_t port;
+  uint32_t bootId;
+  uint32_t seq;
+  unsigned long time;  // signed time of the last heartbeat
+  unsigned long uptimeS;
+  unsigned long lastSeenMs;
+  uint8_t numDoors;
+  uint8_t states[MAX_PEER_DOORS];
+};
+
+struct FleetGateway {
+  FleetPeer peers[MAX_FLEET_PEERS];
+  int lastFanOut;  // peers sent the last fleet command
+};
+
+FleetGateway fleetGateway;
+
+/**
+ * Returns the table entry of the peer with ID `device`, claiming a free entry
+ * (or the least recently heard from) if it is not in the table yet.
+ */
+FleetPeer& fleetFindPeer(uint64_t device) {
+  unsigned long now = millis();
+  FleetPeer* victim = &fleetGateway.peers[0];
+  for (FleetPeer& peer : fleetGateway.peers) {
+    if (peer.used && peer.device == device) return peer;
+    if (!victim->used) continue;
+    if (!peer.used || now - peer.lastSeenMs > now - victim->lastSeenMs) victim = &peer;
+  }
+  *victim = FleetPeer{true, device, IPAddress(), 0, 0, 0, 0, 0, 0, 0, {}};
+  return *victim;
+}
+
+/**
+ * Handles a DLHB datagram: if its tag is valid, it comes from the address it
+ * is signed for, its time is within `REPLAY_WINDOW` of the gateway's, and it
+ * is newer than the last heartbeat of the same device (or comes from a new
+ * boot of it), records the door states it carries.
+ *
+ * Input:
+ *  - ip (IPAddress): the address the heartbeat came from; it must be the one it is
+ *    signed for.
+ *  - port (uint16_t): the port the heartbeat came from.
+ *  - line (const String&): the datagram.
+ *  - pos (int): index of the first token after "DLHB".
+ *
+ * Output: None
+ */
+void fleetHandleHeartbeat(IPAddress ip, uint16_t port, const String& line, int pos) {
+  int tagStart = line.lastIndexOf(' ');
+  if (tagStart <= pos || line.substring(tagStart + 1) != fleetTag(line.substring(0, tagStart))) {
+    Serial.println("Fleet: rejected heartbeat");
+    return;
+  }
+
+  String deviceHex = fleetToken(line, pos);
+  String address = fleetToken(line, pos);
+  uint32_t bootId = strtoul(fleetToken(line, pos).c_str(), nullptr, 16);
+  uint32_t seq = fleetToken(line, pos).toInt();
+  unsigned long time = strtoul(fleetToken(line, pos).c_str(), nullptr, 10);
+  unsigned long uptimeS = fleetToken(line, pos).toInt();
+  String states = fleetToken(line, pos);
+
+  char* end;
+  uint64_t device = strtoull(deviceHex.c_str(), &end, 16);
+  unsigned long now = fleetNow();
+  if (deviceHex.length() == 0 || *end != '\0' || address != ip.toString() + ':' + port ||
+      time + REPLAY_WINDOW < now || time > now + REPLAY_WINDOW) {
+    Serial.println("Fleet: rejected heartbeat");
+    return;
+  }
+
+  FleetPeer& peer = fleetFindPeer(device);
+  // Old or replayed; the sequence only starts over when the peer reboots, and
+  // the time never goes back
+  if (peer.seq != 0 && (time < peer.time || (bootId == peer.bootId && seq <= peer.seq))) return;
+
+  peer.ip = ip;
+  peer.port = port;
+  peer.bootId = bootId;
+  peer.seq = seq;
+  peer.time = time;
+  peer.uptimeS = uptimeS;
+  peer.lastSeenMs = millis();
+  peer.numDoors = 0;
+  int start = 0;
+  while (start < (int)states.length() && peer.numDoors < MAX_PEER_DOORS) {
+    int comma = states.indexOf(',', start);
+    if (comma < 0) comma = states.length();
+    int st = states.substring(start, comma).toInt();
+    peer.states[peer.numDoors++] = constrain(st, 0, NUM_STATES - 1);
+    start = comma + 1;
+  }
+}
+
+/**
+ * Writes the states of the doors in `states` as a comma-separated list of
+ * state names.
+ */
+void writeFleetStates(Print& out, const uint8_t* states, int numStates) {
+  for (int d = 0; d < numStates; d++) {
+    if (d > 0) out.print(',');
+    out.print(stateToString((State)states[d]));
+  }
+}
+
+/**
+ * Writes the fleet snapshot served by GET /fleet: one line per lock, the
+ * gateway itself first, with its address, the time since it was last heard
+ * from and the state of each of its doors. Peers not heard from for
+ * `FLEET_STALE_AFTER` are marked stale.
+ *
+ * Input:
+ *  - out (Print&): where to write the snapshot.
+ *
+ * Output: None
+ */
+void writeFleetSnapshot(Print& out) {
+  uint8_t states[NUM_DOORS];
+  for (int d = 0; d < NUM_DOORS; d++) {
+    states[d] = doors[d].fsm.currentState;
+  }
+  out.print("self 0 ");
+  writeFleetStates(out, states, NUM_DOORS);
+  out.println();
+
+  unsigned long now = millis();
+  for (const FleetPeer& peer : fleetGateway.peers) {
+    if (!peer.used) continue;
+    unsigned long age = now - peer.lastSeenMs;
+    out.print(peer.ip);
+    out.print(':');
+    out.print(peer.port);
+    out.print(' ');
+    out.print(age);
+    out.print(' ');
+    writeFleetStates(out, peer.states, peer.numDoors);
+    if (age > FLEET_STALE_AFTER) out.print(" stale");
+    out.println();
+  }
+}
+
+/**
+ * Sends `cmd` to every door of the gateway and of every peer that is not
+ * stale. Every peer gets the command signed for its own address, with a
+ * nonce made up for this fan out from the time of the request that was just
+ * authenticated, so they apply their usual replay protection to it.
+ *
+ * Input:
+ *  - cmd (Command): LOCK_CMD or UNLOCK_CMD.
+ *
+ * Output: None
+ *
+ * Side effects: sets `pendingCmd` of every door and `fleetGateway.lastFanOut`.
+ */
+void fleetFanOut(Command cmd) {
+  for (Door& door : doors) {
+    door.pendingCmd = cmd;
+  }
+
+  String nonce(journalNow());
+  nonce += '.';
+  nonce += String(random(0x7FFFFFFF), HEX);
+
+  fleetGateway.lastFanOut = 0;
+  unsigned long now = millis();
+  for (const FleetPeer& peer : fleetGateway.peers) {
+    if (!peer.used || now - peer.lastSeenMs > FLEET_STALE_AFTER) continue;
+    String msg = cmd == LOCK_CMD ? "DLCMD lock " : "DLCMD unlock ";
+    msg += peer.ip.toString();
+    msg += ' ';
+    msg += nonce;
+    unsigned char mac[32];
+    computeHMAC(msg, REMOTE_LOCK_PASS, mac);
+    msg += ' ';
+    msg += fleetHex(mac, sizeof(mac));
+    fleetSend(peer.ip, peer.port, msg);
+    fleetGateway.lastFanOut++;
+  }
+}
+
+#endif  // FLEET_GATEWAY
+
+/**
+ * Runs the fleet protocol: handles the datagrams that arrived and, on members,
+ * sends a heartbeat when one is due. Meant to be called every loop().
+ *
+ * Input: None
+ * Output: None
+ */
+void fleetPoll() {
+  if (!wifiLink.up) {
+    if (fleetUdpOpen) fleetUdp.stop();
+    fleetUdpOpen = false;
+    return;
+  }
+  if (!fleetUdpOpen) {
+    fleetUdpOpen = fleetUdp.begin(FLEET_PORT);
+    if (!fleetUdpOpen) return;
+  }
+
+  for (int i = 0; i < FLEET_MAX_PACKETS_PER_POLL; i++) {
+    int size = fleetUdp.parsePacket();
+    if (size <= 0) break;
+    if (size > FLEET_MAX_PACKET) continue;
+    // Our own broadcasts come back to us
+    if (fleetUdp.remoteIP() == WiFi.localIP()) continue;
+
+    char buf[FLEET_MAX_PACKET + 1];
+    int len = fleetUdp.read((unsigned char*)buf, FLEET_MAX_PACKET);
+    buf[max(len, 0)] = '\0';
+    String line(buf);
+    line.trim();
+
+    int pos = 0;
+    String type = fleetToken(line, pos);
+#ifdef FLEET_GATEWAY
+    if (type == "DLHB") fleetHandleHeartbeat(fleetUdp.remoteIP(), fleetUdp.remotePort(), line, pos);
+#endif
+#ifdef FLEET_MEMBER
+    if (type == "DLCMD") fleetHandleCommand(line, pos);
+#endif
+  }
+
+#ifdef FLEET_MEMBER
+  unsigned long now = millis();
+  if (now - fleetMember.lastHeartbeatMs >= FLEET_HEARTBEAT_INTERVAL || fleetStatesChanged()) {
+    fleetSendHeartbeat(now);
+  }
+#endif
+}
+
+#else
+
+inline void fleetPoll() {}
+
+#endif  // FLEET_MEMBER || FLEET_GATEWAY
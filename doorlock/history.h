@@ -0,0 +1,121 @@
+/*
+ * TRANSITION HISTORY
+ *
+ * The last `HISTORY_LEN` FSM transitions of every door, kept in a fixed ring
+ * buffer in RAM for quick diagnostics and streamed as CSV by `GET /history`.
+ * Unlike the journal, it is lost on reset, but recording is cheap enough to
+ * keep the full detail of every transition (position, command and cause).
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+// Note: State, Command and stateToString() must be defined in doorlock.ino
+// before this header is included.
+
+// Number of transitions kept; a power of two so that the ring index is a mask
+const int HISTORY_LEN = 256;
+static_assert((HISTORY_LEN & (HISTORY_LEN - 1)) == 0, "HISTORY_LEN must be a power of two");
+
+// Why the FSM changed state, as far as can be told from the transition
+enum TransitionCause : uint8_t {
+  CAUSE_BUTTON,   // a calibration step
+  CAUSE_COMMAND,  // a lock or unlock command started the motor
+  CAUSE_ARRIVED,  // the motor reached its target
+  CAUSE_TIMEOUT,  // the motor did not reach its target in time
+  CAUSE_MANUAL,   // the lock was turned by hand
+};
+
+struct HistoryRecord {
+  uint32_t ms;     // millis() of the transition
+  int16_t deg;     // servo position the FSM saw
+  uint8_t door;
+  uint8_t states;  // from << 4 | to
+  uint8_t cmd;     // Command given to the FSM
+  uint8_t cause;   // TransitionCause
+};
+
+struct History {
+  HistoryRecord records[HISTORY_LEN];
+  uint32_t count;  // transitions recorded since boot; the newest is at (count - 1) % HISTORY_LEN
+};
+
+History history;
+
+/**
+ * Returns the cause of a transition from `from` to `to`.
+ */
+TransitionCause transitionCause(State from, State to) {
+  if (from == CALIBRATE_LOCK || from == CALIBRATE_UNLOCK) return CAUSE_BUTTON;
+  if (to == BUSY_MOVE) return CAUSE_COMMAND;
+  if (from == BUSY_MOVE) return to == BAD ? CAUSE_TIMEOUT : CAUSE_ARRIVED;
+  return CAUSE_MANUAL;
+}
+
+const char* transitionCauseToString(TransitionCause cause) {
+  switch (cause) {
+    case CAUSE_BUTTON:
+      return "button";
+    case CAUSE_COMMAND:
+      return "command";
+    case CAUSE_ARRIVED:
+      return "arrived";
+    case CAUSE_TIMEOUT:
+      return "timeout";
+    case CAUSE_MANUAL:
+      return "manual";
+  }
+  return "";
+}
+
+/**
+ * Records a transition, overwriting the oldest one once the buffer is full.
+ * Called by `fsmTransition()` on every state change.
+ *
+ * Input:
+ *  - door (int): the door that changed state.
+ *  - from (State), to (State): the states before and after.
+ *  - deg (int): the servo position the FSM saw.
+ *  - ms (unsigned long): the time of the transition.
+ *  - cmd (Command): the command given to the FSM.
+ *
+ * Output: None
+ */
+void historyRecord(int door, State from, State to, int deg, unsigned long ms, Command cmd) {
+  HistoryRecord& r = history.records[history.count & (HISTORY_LEN - 1)];
+  r.ms = ms;
+  r.deg = deg;
+  r.door = door;
+  r.states = from << 4 | to;
+  r.cmd = cmd;
+  r.cause = transitionCause(from, to);
+  history.count++;
+}
+
+/**
+ * Writes the recorded transitions as CSV, oldest first.
+ *
+ * Input:
+ *  - out (Print&): where to write them.
+ *
+ * Output: None
+ */
+void writeHistory(Print& out) {
+  out.println("ms,door,from,to,deg,cmd,cause");
+  uint32_t first = history.count > HISTORY_LEN ? history.count - HISTORY_LEN : 0;
+  for (uint32_t i = first; i != history.count; i++) {
+    const HistoryRecord& r = history.records[i & (HISTORY_LEN - 1)];
+    out.print(r.ms);
+    out.print(',');
+    out.print(r.door);
+    out.print(',');
+    out.print(stateToString((State)(r.states >> 4)));
+    out.print(',');
+    out.print(stateToString((State)(r.states & 0xF)));
+    out.print(',');
+    out.print(r.deg);
+    out.print(r.cmd == LOCK_CMD ? ",lock," : r.cmd == UNLOCK_CMD ? ",unlock," : ",,");
+    out.println(transitionCauseToString((TransitionCause)r.cause));
+  }
+}
@@ -0,0 +1,322 @@
+/*
+ * PERSISTENT EVENT JOURNAL
+ *
+ * An append-only log of lock activity (FSM transitions, commands, failed
+ * authentications and resets) in the EEPROM, which is data flash on the
+ * UNO R4, so that it survives reboots and can be queried with
+ * `GET /journal?from=<unix time>&to=<unix time>`.
+ *
+ * The journal is a ring of `JOURNAL_SLOTS` fixed-size 8-byte records, written
+ * strictly in order, so every slot is written once per lap of the ring (wear
+ * leveling) and the oldest records are overwritten first. Each record carries
+ * the low 16 bits of its record number and a CRC:
+ *  - At boot, the newest valid record is found from the record numbers, and
+ *    appending resumes right after it. A record torn by a power loss fails
+ *    its CRC, so it is ignored and then overwritten.
+ *  - Event records store the time as seconds since the previous record
+ *    (delta encoding). The first record of every page of `JOURNAL_PAGE`
+ *    records is a JOURNAL_CLOCK record with the absolute time, which serves as
+ *    a sparse index: a query binary-searches the page headers for its start
+ *    time and only reads records from there on.
+ *
+ * Times are Unix seconds, estimated from the nonce of the last authenticated
+ * request (a client's clock) plus the time since. Until the first request
+ * after a boot, the clock continues from the last time in the journal, so
+ * times stay monotonic but the downtime is not counted.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "utils.h"
+
+// Note: State, Command, AuthOutcome, ResetCause, stateToString(),
+// authOutcomeToString(), resetCauseToString() and EEPROM_JOURNAL_ADDR must be
+// defined in doorlock.ino before this header is included.
+
+// Number of records in the ring; a power of two so that a record number maps
+// to the same slot on every lap
+const int JOURNAL_SLOTS = 512;
+// Records per page; the first record of every page is a JOURNAL_CLOCK record
+const int JOURNAL_PAGE = 32;
+// At most one JOURNAL_AUTH_FAILURE record is written per this many seconds;
+// the failures in between are counted in the next one
+const unsigned long JOURNAL_AUTH_FAILURE_INTERVAL = 10;
+
+enum JournalEvent : uint8_t {
+  JOURNAL_CLOCK,         // absolute time; no event
+  JOURNAL_BOOT,          // a = ResetCause
+  JOURNAL_TRANSITION,    // a = door, b = from << 4 | to
+  JOURNAL_COMMAND,       // a = door, b = Command
+  JOURNAL_AUTH_FAILURE,  // a = AuthOutcome, b = failures not journaled since the last record
+};
+
+struct JournalRecord {
+  uint16_t seq;  // low 16 bits of the record number
+  uint8_t type;  // JournalEvent
+  // JOURNAL_CLOCK: the absolute time, little-endian. Other events: a, b and
+  // the little-endian seconds since the previous record.
+  uint8_t payload[4];
+  uint8_t crc;  // low byte of the CRC-32 of the bytes above
+};
+static_assert(sizeof(JournalRecord) == 8, "journal records must be 8 bytes");
+
+struct Journal {
+  uint16_t oldestSeq;  // number of the oldest record still in the ring
+  uint16_t nextSeq;    // equal to `oldestSeq` while the journal is empty
+  unsigned long lastTime;   // time of the newest record
+  unsigned long clockBase;  // estimated time at `clockBaseMs`
+  unsigned long clockBaseMs;
+  unsigned long lastAuthFailure;
+  uint8_t suppressedAuthFailures;
+};
+
+Journal journal;
+
+inline int journalSlotAddr(uint16_t seq) {
+  return EEPROM_JOURNAL_ADDR + (seq % JOURNAL_SLOTS) * sizeof(JournalRecord);
+}
+
+inline uint8_t journalCrc(const JournalRecord& r) {
+  return crc32(&r, offsetof(JournalRecord, crc)) & 0xFF;
+}
+
+/**
+ * Reads the record with number `seq` (mod 2^16).
+ *
+ * Output: bool indicating whether the slot holds a valid record with that
+ * number, rather than an older one, a torn one, or erased flash.
+ */
+bool journalRead(uint16_t seq, JournalRecord& r) {
+  EEPROM.get(journalSlotAddr(seq), r);
+  return r.crc == journalCrc(r) && r.seq == seq;
+}
+
+inline unsigned long journalPayloadTime(const JournalRecord& r) {
+  return r.payload[0] | (r.payload[1] << 8) | ((unsigned long)r.payload[2] << 16) |
+         ((unsigned long)r.payload[3] << 24);
+}
+
+inline unsigned long journalDelta(const JournalRecord& r) {
+  return r.payload[2] | (r.payload[3] << 8);
+}
+
+/**
+ * Returns the current time estimate (Unix seconds), never earlier than the
+ * newest record.
+ */
+unsigned long journalNow() {
+  unsigned long now = journal.clockBase + (millis() - journal.clockBaseMs) / 1000;
+  return max(now, journal.lastTime);
+}
+
+/**
+ * Sets the clock from a trusted Unix time, i.e. the nonce of a request that
+ * passed authentication.
+ */
+void journalSetTime(unsigned long unixTime) {
+  journal.clockBase = unixTime;
+  journal.clockBaseMs = millis();
+}
+
+void journalWrite(JournalRecord& r) {
+  r.seq = journal.nextSeq++;
+  r.crc = journalCrc(r);
+  EEPROM.put(journalSlotAddr(r.seq), r);
+  if ((uint16_t)(journal.nextSeq - journal.oldestSeq) > JOURNAL_SLOTS) journal.oldestSeq++;
+}
+
+/**
+ * Finds where the previous boot stopped writing and the time of the newest
+ * record. Must be called once at boot, before anything is journaled.
+ *
+ * Input: None
+ * Output: None
+ */
+void journalBegin() {
+  // Record numbers in the ring span fewer than 2^15 values, so which of two
+  // is newer is well defined.
+  bool found = false;
+  uint16_t ref = 0;
+  int16_t oldestAhead = 0;
+  int16_t newestAhead = 0;
+  for (int slot = 0; slot < JOURNAL_SLOTS; slot++) {
+    JournalRecord r;
+    EEPROM.get(EEPROM_JOURNAL_ADDR + slot * sizeof(JournalRecord), r);
+    if (r.crc != journalCrc(r) || r.seq % JOURNAL_SLOTS != slot) continue;
+    if (!found) {
+      found = true;
+      ref = r.seq;
+    }
+    int16_t ahead = r.seq - ref;
+    oldestAhead = min(oldestAhead, ahead);
+    newestAhead = max(newestAhead, ahead);
+  }
+  if (!found) {
+    journal.oldestSeq = journal.nextSeq = 0;
+    journal.lastTime = 0;
+    return;
+  }
+  uint16_t newest = ref + newestAhead;
+  journal.oldestSeq = ref + oldestAhead;
+  journal.nextSeq = newest + 1;
+
+  // The time of the newest record: its page header plus the deltas after it
+  uint16_t seq = newest - newest % JOURNAL_PAGE;
+  JournalRecord r;
+  unsigned long t = 0;
+  if (journalRead(seq, r) && r.type == JOURNAL_CLOCK) t = journalPayloadTime(r);
+  for (seq++; seq != (uint16_t)(newest + 1); seq++) {
+    if (!journalRead(seq, r)) continue;
+    t = r.type == JOURNAL_CLOCK ? journalPayloadTime(r) : t + journalDelta(r);
+  }
+  journal.lastTime = t;
+  journalSetTime(t);
+}
+
+/**
+ * Appends an event to the journal, preceded by a JOURNAL_CLOCK record if it
+ * starts a new page or is too long after the previous record for a delta.
+ *
+ * Input:
+ *  - type (JournalEvent): the event.
+ *  - a (uint8_t), b (uint8_t): its details; see `JournalEvent`.
+ *
+ * Output: None
+ */
+void journalAppend(JournalEvent type, uint8_t a, uint8_t b) {
+  unsigned long now = journalNow();
+  unsigned long delta = now - journal.lastTime;
+  while (journal.nextSeq % JOURNAL_PAGE == 0 || delta > 0xFFFF) {
+    JournalRecord clock = {0, JOURNAL_CLOCK,
+                           {(uint8_t)now, (uint8_t)(now >> 8), (uint8_t)(now >> 16),
+                            (uint8_t)(now >> 24)},
+                           0};
+    journalWrite(clock);
+    delta = 0;
+  }
+  JournalRecord r = {0, type, {a, b, (uint8_t)delta, (uint8_t)(delta >> 8)}, 0};
+  journalWrite(r);
+  journal.lastTime = now;
+}
+
+/**
+ * Journals a failed authentication, unless one was journaled less than
+ * `JOURNAL_AUTH_FAILURE_INTERVAL` seconds ago; this keeps a flood of bad
+ * requests from wearing out the flash.
+ */
+void journalAuthFailure(AuthOutcome outcome) {
+  unsigned long now = journalNow();
+  if (journal.lastAuthFailure != 0 &&
+      now - journal.lastAuthFailure < JOURNAL_AUTH_FAILURE_INTERVAL) {
+    if (journal.suppressedAuthFailures < 255) journal.suppressedAuthFailures++;
+    return;
+  }
+  journalAppend(JOURNAL_AUTH_FAILURE, outcome, journal.suppressedAuthFailures);
+  journal.lastAuthFailure = now;
+  journal.suppressedAuthFailures = 0;
+}
+
+/**
+ * Writes one record as a CSV line: time, event, door and details.
+ */
+void writeJournalRecord(Print& out, unsigned long t, const JournalRecord& r) {
+  uint8_t a = r.payload[0];
+  uint8_t b = r.payload[1];
+  out.print(t);
+  switch (r.type) {
+    case JOURNAL_BOOT:
+      out.print(",boot,,");
+      out.println(resetCauseToString((ResetCause)a));
+      break;
+    case JOURNAL_TRANSITION:
+      out.print(",transition,");
+      out.print(a);
+      out.print(',');
+      out.print(stateToString((State)(b >> 4)));
+      out.print("->");
+      out.println(stateToString((State)(b & 0xF)));
+      break;
+    case JOURNAL_COMMAND:
+      out.print(",command,");
+      out.print(a);
+      out.println(b == LOCK_CMD ? ",lock" : ",unlock");
+      break;
+    case JOURNAL_AUTH_FAILURE:
+      out.print(",auth_failure,,");
+      out.print(authOutcomeToString((AuthOutcome)a));
+      if (b > 0) {
+        out.print(" (+");
+        out.print(b);
+        out.print(" not journaled)");
+      }
+      out.println();
+      break;
+  }
+}
+
+/**
+ * Writes the journaled events with a time in [`from`, `to`] as CSV, oldest
+ * first. The page headers are binary-searched for the last page that starts
+ * at or before `from`, so only the records from there on are read. Records in
+ * the oldest page whose header has already been overwritten are not reported.
+ *
+ * Input:
+ *  - out (Print&): where to write the events.
+ *  - from (unsigned long): the earliest time of interest (Unix seconds).
+ *  - to (unsigned long): the latest time of interest (Unix seconds).
+ *
+ * Output: None
+ */
+void writeJournal(Print& out, unsigned long from, unsigned long to) {
+  out.println("time,event,door,detail");
+  if (journal.nextSeq == journal.oldestSeq) return;
+
+  // Pages whose header is still in the ring, oldest first
+  uint16_t newest = journal.nextSeq - 1;
+  uint16_t firstPage =
+      journal.oldestSeq + (JOURNAL_PAGE - journal.oldestSeq % JOURNAL_PAGE) % JOURNAL_PAGE;
+  // No page header at all when `firstPage` lies past the newest record; the
+  // division alone would round that up to page 0
+  int16_t span = newest - firstPage;
+  int lastPage = span < 0 ? -1 : span / JOURNAL_PAGE;
+
+  // Binary search for the last page starting at or before `from`. A page
+  // whose header cannot be read is treated as starting after `from`, which
+  // at worst makes the scan start earlier.
+  uint16_t start = journal.oldestSeq;
+  if (lastPage >= 0) {
+    int lo = 0, hi = lastPage;
+    while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      JournalRecord header;
+      if (journalRead(firstPage + mid * JOURNAL_PAGE, header) && header.type == JOURNAL_CLOCK &&
+          journalPayloadTime(header) <= from) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    start = firstPage + lo * JOURNAL_PAGE;
+  }
+
+  bool timeKnown = false;
+  unsigned long t = 0;
+  for (uint16_t seq = start; seq != journal.nextSeq; seq++) {
+    JournalRecord r;
+    if (!journalRead(seq, r)) {
+      timeKnown = false;
+      continue;
+    }
+    if (r.type == JOURNAL_CLOCK) {
+      t = journalPayloadTime(r);
+      timeKnown = true;
+      continue;
+    }
+    t += journalDelta(r);
+    if (!timeKnown || t < from) continue;
+    if (t > to) break;
+    writeJournalRecord(out, t, r);
+  }
+}
@@ -0,0 +1,133 @@
+/*
+ * PRECOMPUTED LED MATRIX FRAMES
+ *
+ * A tiny 3x5 pixel font and a `constexpr` renderer that turns short strings
+ * into 12x8 frames for the UNO R4 LED matrix at compile time. Showing one of
+ * these frames is a single `matrix.loadFrame()` call instead of a pass through
+ * the ArduinoGraphics text pipeline.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+const int MATRIX_WIDTH = 12;
+const int MATRIX_HEIGHT = 8;
+
+// Glyphs are 3 pixels wide and 5 tall, drawn with one column of spacing.
+const int GLYPH_WIDTH = 3;
+const int GLYPH_HEIGHT = 5;
+const int GLYPH_ADVANCE = GLYPH_WIDTH + 1;
+// Row of the matrix the top of the text is drawn on
+const int TEXT_TOP = 1;
+
+// A 12x8 frame in the format `ArduinoLEDMatrix::loadFrame()` takes: pixels in
+// row-major order, the first pixel being the most significant bit of words[0].
+struct Frame {
+  uint32_t words[3];
+};
+
+/**
+ * Returns row `row` (0 = top) of the glyph for `c`, as 3 bits with the
+ * leftmost pixel in the most significant bit. Unknown characters are blank.
+ */
+constexpr uint8_t glyphRow(char c, int row) {
+  switch (c) {
+    case 'B': {
+      constexpr uint8_t g[GLYPH_HEIGHT] = {0b110, 0b101, 0b110, 0b101, 0b110};
+      return g[row];
+    }
+    case 'C': {
+      constexpr uint8_t g[GLYPH_HEIGHT] = {0b011, 0b100, 0b100, 0b100, 0b011};
+      return g[row];
+    }
+    case 'K': {
+      constexpr uint8_t g[GLYPH_HEIGHT] = {0b101, 0b101, 0b110, 0b101, 0b101};
+      return g[row];
+    }
+    case 'L': {
+      constexpr uint8_t g[GLYPH_HEIGHT] = {0b100, 0b100, 0b100, 0b100, 0b111};
+      return g[row];
+    }
+    case 'M': {
+      constexpr uint8_t g[GLYPH_HEIGHT] = {0b101, 0b111, 0b111, 0b101, 0b101};
+      return g[row];
+    }
+    case 'O': {
+      constexpr uint8_t g[GLYPH_HEIGHT] = {0b010, 0b101, 0b101, 0b101, 0b010};
+      return g[row];
+    }
+    case 'U': {
+      constexpr uint8_t g[GLYPH_HEIGHT] = {0b101, 0b101, 0b101, 0b101, 0b111};
+      return g[row];
+    }
+    case 'W': {
+      constexpr uint8_t g[GLYPH_HEIGHT] = {0b101, 0b101, 0b111, 0b111, 0b101};
+      return g[row];
+    }
+    case '!': {
+      constexpr uint8_t g[GLYPH_HEIGHT] = {0b010, 0b010, 0b010, 0b000, 0b010};
+      return g[row];
+    }
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Returns `frame` with the pixel at (`x`, `y`) turned on. Pixels outside the
+ * matrix are ignored.
+ */
+constexpr Frame setPixel(Frame frame, int x, int y) {
+  if (x < 0 || x >= MATRIX_WIDTH || y < 0 || y >= MATRIX_HEIGHT) return frame;
+  int i = y * MATRIX_WIDTH + x;
+  frame.words[i / 32] |= 1UL << (31 - i % 32);
+  return frame;
+}
+
+/**
+ * Renders `text` left-aligned onto an otherwise blank frame. Meant to be
+ * evaluated at compile time; at most three characters fit on the matrix.
+ *
+ * Input:
+ *  - text (const char*): the text to render.
+ *
+ * Output: the rendered frame.
+ */
+constexpr Frame renderText(const char* text) {
+  Frame frame = {{0, 0, 0}};
+  for (int i = 0; text[i] != '\0'; i++) {
+    for (int row = 0; row < GLYPH_HEIGHT; row++) {
+      uint8_t bits = glyphRow(text[i], row);
+      for (int col = 0; col < GLYPH_WIDTH; col++) {
+        if (bits & (1 << (GLYPH_WIDTH - 1 - col))) {
+          frame = setPixel(frame, i * GLYPH_ADVANCE + col, TEXT_TOP + row);
+        }
+      }
+    }
+  }
+  return frame;
+}
+
+/**
+ * Returns `frame` with the leftmost `columns` pixels of the bottom row turned
+ * on, to be used as a progress bar.
+ */
+constexpr Frame withProgressBar(Frame frame, int columns) {
+  for (int x = 0; x < columns; x++) {
+    frame = setPixel(frame, x, MATRIX_HEIGHT - 1);
+  }
+  return frame;
+}
+
+// `base` with a progress bar of every possible length (0 to MATRIX_WIDTH
+// pixels), so that showing progress is just indexing into `frames`.
+struct ProgressFrames {
+  Frame frames[MATRIX_WIDTH + 1];
+
+  constexpr ProgressFrames(Frame base) : frames() {
+    for (int n = 0; n <= MATRIX_WIDTH; n++) {
+      frames[n] = withProgressBar(base, n);
+    }
+  }
+};
@@ -0,0 +1,127 @@
+/*
+ * TIMER-DRIVEN LED MATRIX ANIMATIONS
+ *
+ * A frame-sequence player that runs from a hardware timer interrupt, so that
+ * animations keep going without loop() spending any time on them. The player
+ * only ever copies precomputed frames to the matrix. It has two modes:
+ *  - ANIM_CYCLE shows `frames` one after another, each for `ticksPerFrame`
+ *    timer ticks, and starts over at the end (e.g. a blinking alert).
+ *  - ANIM_INDEXED shows `frames[index]`, where `index` is set by loop() (e.g.
+ *    a progress bar following the measured servo position).
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <Arduino_LED_Matrix.h>
+#include <FspTimer.h>
+#include "led_frames.h"
+
+// Note: matrix must be defined in doorlock.ino before this header is included.
+
+// Frequency of the player's timer interrupt (Hz)
+const float LED_PLAYER_HZ = 10.0;
+
+enum AnimationMode { ANIM_NONE, ANIM_CYCLE, ANIM_INDEXED };
+
+struct LedPlayer {
+  FspTimer timer;
+  // Shared with the interrupt. loop() writes `mode` last when starting an
+  // animation and first when stopping one, so the interrupt never sees a
+  // half-configured animation.
+  const Frame* volatile frames;
+  volatile uint8_t count;
+  volatile uint8_t ticksPerFrame;
+  volatile uint8_t index;
+  volatile AnimationMode mode;
+  // Only touched by the interrupt while an animation is playing. `shown` is
+  // false until the first frame of the current animation is on the matrix.
+  // loop() resets `shown` and `tick` before writing `mode`, so they are
+  // volatile too, which keeps the compiler from moving them past it.
+  volatile bool shown;
+  uint8_t shownIndex;
+  volatile uint8_t tick;
+};
+
+LedPlayer ledPlayer;
+
+/**
+ * The timer interrupt: shows the next frame of the current animation, if it
+ * differs from the one already on the matrix.
+ */
+void ledPlayerIsr(timer_callback_args_t* args) {
+  AnimationMode mode = ledPlayer.mode;
+  if (mode == ANIM_NONE) return;
+
+  uint8_t next;
+  if (mode == ANIM_CYCLE) {
+    if (ledPlayer.shown && ++ledPlayer.tick < ledPlayer.ticksPerFrame) return;
+    ledPlayer.tick = 0;
+    next = ledPlayer.shown ? (ledPlayer.shownIndex + 1) % ledPlayer.count : 0;
+  } else {
+    next = ledPlayer.index;
+    if (next >= ledPlayer.count || (ledPlayer.shown && next == ledPlayer.shownIndex)) return;
+  }
+
+  ledPlayer.shown = true;
+  ledPlayer.shownIndex = next;
+  matrix.loadFrame(ledPlayer.frames[next].words);
+}
+
+/**
+ * Starts the player's timer. Must be called after `matrix.begin()`, which
+ * claims a timer of its own.
+ *
+ * Input: None
+ *
+ * Output: bool indicating whether a timer was available.
+ */
+bool ledPlayerBegin() {
+  uint8_t type;
+  int8_t channel = FspTimer::get_available_timer(type);
+  if (channel < 0) {
+    Serial.println("No timer left for LED animations");
+    return false;
+  }
+  ledPlayer.timer.begin(TIMER_MODE_PERIODIC, type, channel, LED_PLAYER_HZ, 0.0f, ledPlayerIsr);
+  ledPlayer.timer.setup_overflow_irq();
+  ledPlayer.timer.open();
+  ledPlayer.timer.start();
+  return true;
+}
+
+/**
+ * Starts cycling through `count` frames, showing each for `ticksPerFrame`
+ * timer ticks.
+ */
+void ledPlayerCycle(const Frame* frames, uint8_t count, uint8_t ticksPerFrame) {
+  ledPlayer.mode = ANIM_NONE;
+  ledPlayer.shown = false;
+  ledPlayer.tick = 0;
+  ledPlayer.frames = frames;
+  ledPlayer.count = count;
+  ledPlayer.ticksPerFrame = ticksPerFrame;
+  ledPlayer.index = 0;
+  ledPlayer.mode = ANIM_CYCLE;
+}
+
+/**
+ * Starts showing `frames[index]` out of `count` frames; change which one with
+ * `ledPlayerSetIndex()`.
+ */
+void ledPlayerIndexed(const Frame* frames, uint8_t count) {
+  ledPlayer.mode = ANIM_NONE;
+  ledPlayer.shown = false;
+  ledPlayer.frames = frames;
+  ledPlayer.count = count;
+  ledPlayer.index = 0;
+  ledPlayer.mode = ANIM_INDEXED;
+}
+
+inline void ledPlayerSetIndex(uint8_t index) { ledPlayer.index = index; }
+
+/**
+ * Stops the current animation, leaving its last frame on the matrix. After
+ * this returns, the interrupt no longer touches the matrix.
+ */
+void ledPlayerStop() { ledPlayer.mode = ANIM_NONE; }
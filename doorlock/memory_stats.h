@@ -0,0 +1,122 @@
+/*
+ * STACK AND HEAP USAGE
+ *
+ * Paints the unused part of the stack with a known pattern at boot, and
+ * periodically scans for the deepest word that has been overwritten since,
+ * which gives the stack high-water mark. Heap usage and fragmentation come
+ * from newlib's `mallinfo()`.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <malloc.h>
+
+// Provided by the linker script
+extern "C" {
+extern uint32_t __StackLimit;
+extern uint32_t __StackTop;
+extern char __HeapBase;
+extern char __HeapLimit;
+char* sbrk(int incr);
+}
+
+const uint32_t STACK_PAINT = 0xA5A5A5A5;
+// Don't paint the words right below the stack pointer of the painting function
+const size_t STACK_PAINT_MARGIN = 64;
+// How often `memoryStatsPoll()` rescans the stack (milliseconds)
+const unsigned long STACK_SCAN_INTERVAL = 1000;
+
+struct MemoryStats {
+  size_t stackSize;
+  size_t stackHighWater;  // deepest stack usage seen, in bytes
+  size_t heapSize;
+  size_t heapUsed;        // bytes in allocated chunks
+  size_t heapFree;        // free bytes, both in free chunks and never claimed
+  size_t heapFreeChunks;  // more chunks for the same free bytes = more fragmented
+  unsigned long lastScanMs;
+};
+
+MemoryStats memoryStats;
+
+/**
+ * Fills the unused part of the stack with `STACK_PAINT`. Must be called at
+ * the very beginning of `setup()`, while the stack is still shallow.
+ *
+ * Input: None
+ * Output: None
+ */
+void paintStack() {
+  uint32_t* sp = (uint32_t*)(__get_MSP() - STACK_PAINT_MARGIN);
+  for (uint32_t* p = &__StackLimit; p < sp; p++) {
+    *p = STACK_PAINT;
+  }
+  memoryStats.stackSize = (char*)&__StackTop - (char*)&__StackLimit;
+}
+
+/**
+ * Returns the number of stack bytes that have been used at some point since
+ * `paintStack()`. The stack grows down from `__StackTop`, so this is the
+ * distance from the top to the lowest word that no longer holds the paint.
+ */
+size_t scanStackHighWater() {
+  uint32_t* p = &__StackLimit;
+  while (p < &__StackTop && *p == STACK_PAINT) p++;
+  return (char*)&__StackTop - (char*)p;
+}
+
+/**
+ * Refreshes every field of `memoryStats`.
+ *
+ * Input: None
+ * Output: None
+ */
+void updateMemoryStats() {
+  memoryStats.stackHighWater = scanStackHighWater();
+
+  struct mallinfo mi = mallinfo();
+  char* heapEnd = sbrk(0);
+  memoryStats.heapSize = &__HeapLimit - &__HeapBase;
+  memoryStats.heapUsed = mi.uordblks;
+  memoryStats.heapFree = mi.fordblks + (&__HeapLimit - heapEnd);
+  memoryStats.heapFreeChunks = mi.ordblks;
+  memoryStats.lastScanMs = millis();
+}
+
+/**
+ * Calls `updateMemoryStats()` if `STACK_SCAN_INTERVAL` has passed since the
+ * last update. Meant to be called from `loop()`.
+ *
+ * Input: None
+ * Output: None
+ */
+void memoryStatsPoll() {
+  if (millis() - memoryStats.lastScanMs >= STACK_SCAN_INTERVAL) {
+    updateMemoryStats();
+  }
+}
+
+/**
+ * Prints the memory statistics in a human-readable form.
+ *
+ * Input:
+ *  - out (Print&): where to print, e.g. `Serial`.
+ *
+ * Output: None
+ */
+void printMemoryStats(Print& out) {
+  out.print("Stack: ");
+  out.print(memoryStats.stackHighWater);
+  out.print(" / ");
+  out.print(memoryStats.stackSize);
+  out.println(" bytes used at most");
+  out.print("Heap: ");
+  out.print(memoryStats.heapUsed);
+  out.print(" bytes used, ");
+  out.print(memoryStats.heapFree);
+  out.print(" bytes free in ");
+  out.print(memoryStats.heapFreeChunks);
+  out.print(" free chunks, ");
+  out.print(memoryStats.heapSize);
+  out.println(" bytes total");
+}
@@ -0,0 +1,390 @@
+/*
+ * METRICS FOR THE DOORLOCK
+ *
+ * Fixed-size counters and histograms describing what the lock has been doing
+ * since boot, and a writer that exports them in the Prometheus text format for
+ * the `GET /metrics` endpoint. Nothing in here allocates memory, so scraping
+ * the lock is safe no matter how long it has been running.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "admission.h"
+#include "event_queue.h"
+#include "memory_stats.h"
+#include "utils.h"
+#include "watchdog.h"
+#include "wifi_link.h"
+
+// Note: State, Request, NUM_STATES, NUM_REQUEST_TYPES, doors, NUM_DOORS,
+// stateToString() and requestToRoute() must be defined in doorlock.ino before
+// this header is included, as well as everything watchdog.h needs.
+
+// Outcomes of `verifyAuthentication()`
+enum AuthOutcome {
+  AUTH_OK,
+  AUTH_BAD_NONCE,
+  AUTH_REPLAY,
+  AUTH_BAD_SIGNATURE,
+  AUTH_MISMATCH,
+  NUM_AUTH_OUTCOMES
+};
+
+// Status codes we track per route. Responses with any other code are not
+// counted.
+const int METRICS_STATUS_CODES[] = {200, 204, 400, 403, 404, 503};
+const int NUM_METRICS_STATUS_CODES = sizeof(METRICS_STATUS_CODES) / sizeof(int);
+
+// Histogram bucket upper bounds (milliseconds). The implicit last bucket is +Inf.
+const int MAX_HISTOGRAM_BUCKETS = 12;
+const unsigned long LOOP_BUCKETS_MS[] = {1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500};
+const unsigned long MOVE_BUCKETS_MS[] = {250, 500, 1000, 1500, 2000, 3000, 4000, 5000};
+// Response writes are timed in microseconds
+const unsigned long WRITE_BUCKETS_US[] = {250,   500,   1000,   2500,   5000,
+                                          10000, 25000, 50000, 100000, 250000};
+
+/**
+ * A cumulative histogram with at most `MAX_HISTOGRAM_BUCKETS` buckets whose
+ * upper bounds are given by `bounds`.
+ */
+struct Histogram {
+  const unsigned long* bounds;
+  int numBounds;
+  // counts[i] is the number of observations in (bounds[i - 1], bounds[i]];
+  // counts[numBounds] holds the ones greater than every bound.
+  unsigned long counts[MAX_HISTOGRAM_BUCKETS + 1];
+  unsigned long sum;
+  unsigned long count;
+
+  /**
+   * Records a single observation.
+   *
+   * Input:
+   *  - v (unsigned long): the observed value, in the same unit as `bounds`.
+   *
+   * Output: None
+   */
+  void observe(unsigned long v) {
+    int i = 0;
+    while (i < numBounds && v > bounds[i]) i++;
+    counts[i]++;
+    sum += v;
+    count++;
+  }
+};
+
+struct Metrics {
+  unsigned long requests[NUM_REQUEST_TYPES][NUM_METRICS_STATUS_CODES];
+  unsigned long auth[NUM_AUTH_OUTCOMES];
+  unsigned long transitions[NUM_STATES][NUM_STATES];
+  Histogram loopMs;
+  Histogram moveMs;
+  Histogram writeUs;
+  ResetCause resetCause;
+  // Milliseconds from reset until the WiFi connected, the servo was
+  // calibrated, and the lock was ready to serve requests
+  unsigned long bootWifiMs;
+  unsigned long bootCalibrationMs;
+  unsigned long bootMs;
+};
+
+Metrics metrics = {
+  {},
+  {},
+  {},
+  {LOOP_BUCKETS_MS, sizeof(LOOP_BUCKETS_MS) / sizeof(unsigned long), {}, 0, 0},
+  {MOVE_BUCKETS_MS, sizeof(MOVE_BUCKETS_MS) / sizeof(unsigned long), {}, 0, 0},
+  {WRITE_BUCKETS_US, sizeof(WRITE_BUCKETS_US) / sizeof(unsigned long), {}, 0, 0},
+  RESET_PIN,
+  0,
+  0,
+  0,
+};
+
+/**
+ * Counts a response sent for a request.
+ *
+ * Input:
+ *  - req (Request): the request that was answered.
+ *  - code (int): the HTTP status code of the response.
+ *
+ * Output: None
+ */
+void metricsRecordRequest(Request req, int code) {
+  for (int i = 0; i < NUM_METRICS_STATUS_CODES; i++) {
+    if (METRICS_STATUS_CODES[i] == code) {
+      metrics.requests[req][i]++;
+      return;
+    }
+  }
+}
+
+/**
+ * Counts an outcome of `verifyAuthentication()`.
+ *
+ * Input:
+ *  - outcome (AuthOutcome): how the authentication attempt ended.
+ *
+ * Output: None
+ */
+void metricsRecordAuth(AuthOutcome outcome) { metrics.auth[outcome]++; }
+
+/**
+ * Counts an FSM transition between two different states.
+ *
+ * Input:
+ *  - from (State): the state the FSM left.
+ *  - to (State): the state the FSM entered.
+ *
+ * Output: None
+ */
+void metricsRecordTransition(State from, State to) { metrics.transitions[from][to]++; }
+
+const char* authOutcomeToString(AuthOutcome outcome) {
+  switch (outcome) {
+    case AUTH_OK:
+      return "ok";
+    case AUTH_BAD_NONCE:
+      return "bad_nonce";
+    case AUTH_REPLAY:
+      return "replay";
+    case AUTH_BAD_SIGNATURE:
+      return "bad_signature";
+    case AUTH_MISMATCH:
+      return "mismatch";
+    default:
+      return "unknown";
+  }
+}
+
+/**
+ * Writes the `# HELP` and `# TYPE` lines that precede a metric family.
+ */
+void writeMetricHeader(Print& out, const char* name, const char* type, const char* help) {
+  out.print("# HELP ");
+  out.print(name);
+  out.print(" ");
+  out.println(help);
+  out.print("# TYPE ");
+  out.print(name);
+  out.print(" ");
+  out.println(type);
+}
+
+/**
+ * Writes a histogram in the Prometheus text format.
+ *
+ * Input:
+ *  - out (Print&): where to write the histogram.
+ *  - name (const char*): name of the metric family.
+ *  - help (const char*): description of the metric family.
+ *  - h (const Histogram&): the histogram to write.
+ *
+ * Output: None
+ */
+void writeHistogram(Print& out, const char* name, const char* help, const Histogram& h) {
+  writeMetricHeader(out, name, "histogram", help);
+  unsigned long cumulative = 0;
+  for (int i = 0; i <= h.numBounds; i++) {
+    cumulative += h.counts[i];
+    out.print(name);
+    out.print("_bucket{le=\"");
+    if (i < h.numBounds) {
+      out.print(h.bounds[i]);
+    } else {
+      out.print("+Inf");
+    }
+    out.print("\"} ");
+    out.println(cumulative);
+  }
+  out.print(name);
+  out.print("_sum ");
+  out.println(h.sum);
+  out.print(name);
+  out.print("_count ");
+  out.println(h.count);
+}
+
+/**
+ * Writes every metric in the Prometheus text exposition format. Counters that
+ * are still zero are skipped to keep the response small.
+ *
+ * Input:
+ *  - out (Print&): where to write the metrics, usually a `BufferedPrint`
+ *    wrapping the HTTP client.
+ *
+ * Output: None
+ */
+void writeMetrics(Print& out) {
+  writeMetricHeader(out, "doorlock_http_requests_total", "counter",
+                    "HTTP responses sent, by route and status code.");
+  for (int r = 0; r < NUM_REQUEST_TYPES; r++) {
+    for (int c = 0; c < NUM_METRICS_STATUS_CODES; c++) {
+      if (metrics.requests[r][c] == 0) continue;
+      out.print("doorlock_http_requests_total{route=\"");
+      out.print(requestToRoute((Request)r));
+      out.print("\",code=\"");
+      out.print(METRICS_STATUS_CODES[c]);
+      out.print("\"} ");
+      out.println(metrics.requests[r][c]);
+    }
+  }
+
+  writeMetricHeader(out, "doorlock_auth_total", "counter",
+                    "Authentication attempts, by outcome.");
+  for (int a = 0; a < NUM_AUTH_OUTCOMES; a++) {
+    out.print("doorlock_auth_total{outcome=\"");
+    out.print(authOutcomeToString((AuthOutcome)a));
+    out.print("\"} ");
+    out.println(metrics.auth[a]);
+  }
+
+  writeMetricHeader(out, "doorlock_fsm_transitions_total", "counter",
+                    "FSM transitions, by source and destination state.");
+  for (int from = 0; from < NUM_STATES; from++) {
+    for (int to = 0; to < NUM_STATES; to++) {
+      if (metrics.transitions[from][to] == 0) continue;
+      out.print("doorlock_fsm_transitions_total{from=\"");
+      out.print(stateToString((State)from));
+      out.print("\",to=\"");
+      out.print(stateToString((State)to));
+      out.print("\"} ");
+      out.println(metrics.transitions[from][to]);
+    }
+  }
+
+  writeMetricHeader(out, "doorlock_door_state", "gauge",
+                    "Current FSM state of each door; the series present is always 1.");
+  for (int d = 0; d < NUM_DOORS; d++) {
+    out.print("doorlock_door_state{door=\"");
+    out.print(d);
+    out.print("\",state=\"");
+    out.print(stateToString(doors[d].fsm.currentState));
+    out.println("\"} 1");
+  }
+
+  writeHistogram(out, "doorlock_busy_move_duration_ms",
+                 "Time spent in BUSY_MOVE per move, in milliseconds.", metrics.moveMs);
+  writeHistogram(out, "doorlock_loop_duration_ms",
+                 "Time spent in one loop() iteration excluding the trailing delay, in "
+                 "milliseconds.",
+                 metrics.loopMs);
+  writeHistogram(out, "doorlock_response_write_duration_us",
+                 "Time spent writing one HTTP response, in microseconds.", metrics.writeUs);
+
+  writeMetricHeader(out, "doorlock_uptime_seconds", "gauge", "Seconds since boot.");
+  out.print("doorlock_uptime_seconds ");
+  out.println(millis() / 1000);
+
+  writeMetricHeader(out, "doorlock_boot_duration_ms", "gauge",
+                    "Milliseconds from reset until each boot stage finished.");
+  out.print("doorlock_boot_duration_ms{stage=\"wifi\"} ");
+  out.println(metrics.bootWifiMs);
+  out.print("doorlock_boot_duration_ms{stage=\"calibration\"} ");
+  out.println(metrics.bootCalibrationMs);
+  out.print("doorlock_boot_duration_ms{stage=\"ready\"} ");
+  out.println(metrics.bootMs);
+
+  writeMetricHeader(out, "doorlock_wifi_up", "gauge", "Whether the WiFi link is up.");
+  out.print("doorlock_wifi_up ");
+  out.println(wifiLink.up ? 1 : 0);
+
+  writeMetricHeader(out, "doorlock_wifi_rssi_dbm", "gauge",
+                    "WiFi signal strength, latest and weakest sample since boot.");
+  out.print("doorlock_wifi_rssi_dbm{sample=\"last\"} ");
+  out.println(wifiLink.rssi);
+  out.print("doorlock_wifi_rssi_dbm{sample=\"min\"} ");
+  out.println(wifiLink.minRssi);
+
+  writeMetricHeader(out, "doorlock_wifi_disconnects_total", "counter",
+                    "Times the WiFi link was lost after boot.");
+  out.print("doorlock_wifi_disconnects_total ");
+  out.println(wifiLink.disconnects);
+
+  writeMetricHeader(out, "doorlock_wifi_reconnect_attempts_total", "counter",
+                    "WiFi reconnect attempts.");
+  out.print("doorlock_wifi_reconnect_attempts_total ");
+  out.println(wifiLink.reconnectAttempts);
+
+  writeMetricHeader(out, "doorlock_wifi_downtime_ms_total", "counter",
+                    "Time the WiFi link has been down since boot, in milliseconds.");
+  out.print("doorlock_wifi_downtime_ms_total ");
+  out.println(wifiDowntimeMs());
+
+  writeMetricHeader(out, "doorlock_reset_cause", "gauge", "Cause of the last reset.");
+  out.print("doorlock_reset_cause{cause=\"");
+  out.print(resetCauseToString(metrics.resetCause));
+  out.println("\"} 1");
+
+  writeMetricHeader(out, "doorlock_watchdog_budget_ms", "gauge",
+                    "Watchdog timeout, in milliseconds.");
+  out.print("doorlock_watchdog_budget_ms ");
+  out.println(wdtInterval);
+
+  writeMetricHeader(out, "doorlock_watchdog_worst_interval_ms", "gauge",
+                    "Longest time between two watchdog refreshes since boot, in milliseconds.");
+  out.print("doorlock_watchdog_worst_interval_ms ");
+  out.println(watchdogStats.worstIntervalMs);
+
+  writeMetricHeader(out, "doorlock_watchdog_warnings_total", "counter",
+                    "Watchdog refreshes that used more than the warning fraction of the budget.");
+  out.print("doorlock_watchdog_warnings_total ");
+  out.println(watchdogStats.warnings);
+
+  writeMetricHeader(out, "doorlock_events_dropped_total", "counter",
+                    "Interrupt events (e.g. button presses) lost because the event queue was full.");
+  out.print("doorlock_events_dropped_total ");
+  out.println(eventQueue.dropped);
+
+  writeMetricHeader(out, "doorlock_admission_commands_first_total", "counter",
+                    "Lock and unlock commands served ahead of reads that arrived before them.");
+  out.print("doorlock_admission_commands_first_total ");
+  out.println(admission.commandsFirst);
+
+  writeMetricHeader(out, "doorlock_admission_shed_total", "counter",
+                    "Reads answered with 503 and Retry-After, unparsed, while overloaded.");
+  out.print("doorlock_admission_shed_total ");
+  out.println(admission.shed);
+
+  if (watchdogStats.hasLastCrash) {
+    const CrashRecord& crash = watchdogStats.lastCrash;
+    writeMetricHeader(out, "doorlock_last_watchdog_reset", "gauge",
+                      "What the lock was doing when the watchdog last reset it, by door.");
+    for (int d = 0; d < NUM_DOORS; d++) {
+      out.print("doorlock_last_watchdog_reset{door=\"");
+      out.print(d);
+      out.print("\",phase=\"");
+      out.print(phaseToString((Phase)crash.phase));
+      out.print("\",state=\"");
+      out.print(stateToString((State)crash.states[d]));
+      out.print("\",route=\"");
+      out.print(requestToRoute((Request)crash.request));
+      out.println("\"} 1");
+    }
+  }
+
+  writeMetricHeader(out, "doorlock_stack_bytes", "gauge",
+                    "Stack size and the most of it ever used, in bytes.");
+  out.print("doorlock_stack_bytes{kind=\"size\"} ");
+  out.println(memoryStats.stackSize);
+  out.print("doorlock_stack_bytes{kind=\"high_water\"} ");
+  out.println(memoryStats.stackHighWater);
+
+  writeMetricHeader(out, "doorlock_heap_bytes", "gauge", "Heap size and usage, in bytes.");
+  out.print("doorlock_heap_bytes{kind=\"size\"} ");
+  out.println(memoryStats.heapSize);
+  out.print("doorlock_heap_bytes{kind=\"used\"} ");
+  out.println(memoryStats.heapUsed);
+  out.print("doorlock_heap_bytes{kind=\"free\"} ");
+  out.println(memoryStats.heapFree);
+
+  writeMetricHeader(out, "doorlock_heap_free_chunks", "gauge",
+                    "Number of free heap chunks; grows with fragmentation.");
+  out.print("doorlock_heap_free_chunks ");
+  out.println(memoryStats.heapFreeChunks);
+
+#ifdef PROFILE_LOOP
+  writeProfile(out);
+#endif
+}
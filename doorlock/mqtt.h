@@ -0,0 +1,241 @@
+/*
+ * MQTT CLIENT
+ *
+ * Publishes the state of every door to an MQTT broker and takes commands from
+ * it, so that home-automation systems can watch the lock without polling
+ * GET /status. The lock keeps one persistent connection to the broker:
+ *  - `<MQTT_TOPIC>/doors/<id>/state` is published, retained, on every state
+ *    change, with the state name as payload (the same body as GET /status).
+ *  - `<MQTT_TOPIC>/doors/<id>/command` is subscribed to. Payloads are
+ *    "<lock|unlock> <nonce> <signature>", where the signature is the HMAC of
+ *    "MQTT <lock|unlock> <id> <nonce>"; the nonce is checked the same way as
+ *    the X-Nonce of an HTTP request. The "MQTT" tag, action and door being
+ *    signed, an HTTP signature or one for another door is rejected.
+ *  - `<MQTT_TOPIC>/online` is a retained "1" while the lock is connected, and
+ *    the broker replaces it with "0" (the will) once the lock is gone.
+ * State changes that happen while the broker is unreachable are queued, up to
+ * `MQTT_QUEUE_LEN` of them (the oldest are dropped first), and published when
+ * the connection is back, followed by the current state of every door.
+ *
+ * Only compiled in when MQTT_BROKER is defined in config.h.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiS3.h>
+#include "wifi_link.h"
+
+// Note: doors, NUM_DOORS, State, Command, stateToString(),
+// verifyAuthentication(), watchdogRefresh() and MQTT_CONNECT_TIMEOUT (the loop
+// budget) must be defined in doorlock.ino before this header is included.
+
+#ifdef MQTT_BROKER
+
+#include <ArduinoMqttClient.h>
+
+#ifndef MQTT_PORT
+#define MQTT_PORT 1883
+#endif
+#ifndef MQTT_TOPIC
+#define MQTT_TOPIC "doorlock"
+#endif
+
+// Most state changes kept while the broker is unreachable
+const int MQTT_QUEUE_LEN = 16;
+const unsigned long MQTT_KEEP_ALIVE = 15000;
+// Backoff between connection attempts (milliseconds)
+const unsigned long MQTT_BACKOFF_MIN = 1000;
+const unsigned long MQTT_BACKOFF_MAX = 60000;
+// Longest command payload accepted
+const int MQTT_MAX_COMMAND = 96;
+
+struct MqttStateChange {
+  uint8_t door;
+  State state;
+};
+
+struct Mqtt {
+  MqttStateChange queue[MQTT_QUEUE_LEN];  // ring buffer of unpublished changes
+  int head;
+  int size;
+  unsigned long dropped;  // changes dropped because the queue was full
+  unsigned long connects;
+  unsigned long backoffMs;
+  unsigned long lastAttemptMs;
+  IPAddress brokerIp;  // MQTT_BROKER, resolved
+  bool resolved;
+};
+
+WiFiClient mqttNet;
+MqttClient mqttClient(mqttNet);
+Mqtt mqtt = {{}, 0, 0, 0, 0, MQTT_BACKOFF_MIN, 0};
+
+/**
+ * Queues the publication of `state` as the state of door `door`, dropping the
+ * oldest queued change if the queue is full.
+ */
+void mqttEnqueue(int door, State state) {
+  if (mqtt.size == MQTT_QUEUE_LEN) {
+    mqtt.head = (mqtt.head + 1) % MQTT_QUEUE_LEN;
+    mqtt.size--;
+    mqtt.dropped++;
+  }
+  mqtt.queue[(mqtt.head + mqtt.size) % MQTT_QUEUE_LEN] = MqttStateChange{(uint8_t)door, state};
+  mqtt.size++;
+}
+
+/**
+ * Records that `door` went to state `to`, to be published. Called by
+ * `fsmTransition()` on every state change.
+ *
+ * Input:
+ *  - door (const Door&): the door that changed state.
+ *  - to (State): its new state.
+ *
+ * Output: None
+ */
+void mqttRecordTransition(const Door& door, State to) { mqttEnqueue(&door - doors, to); }
+
+/**
+ * Publishes `change` as the retained state of its door.
+ *
+ * Output: bool indicating whether the message was handed to the connection.
+ */
+bool mqttPublishState(const MqttStateChange& change) {
+  String topic = MQTT_TOPIC "/doors/";
+  topic += change.door;
+  topic += "/state";
+  mqttClient.beginMessage(topic, true);
+  mqttClient.print(stateToString(change.state));
+  return mqttClient.endMessage();
+}
+
+/**
+ * Handles a message on a command topic; called by `mqttClient.poll()`. A
+ * command whose signature covers its action, door and nonce and that passes
+ * authentication is given to its door's next tick.
+ *
+ * Input:
+ *  - size (int): the length of the payload.
+ *
+ * Output: None
+ */
+void mqttOnMessage(int size) {
+  String topic = mqttClient.messageTopic();
+  const String prefix = MQTT_TOPIC "/doors/";
+  int slash = topic.indexOf('/', prefix.length());
+  if (!topic.startsWith(prefix) || slash < 0 || !topic.endsWith("/command")) return;
+  String id = topic.substring(prefix.length(), slash);
+  int door = id.toInt();
+
+  char payload[MQTT_MAX_COMMAND + 1];
+  int len = 0;
+  while (mqttClient.available() && len < MQTT_MAX_COMMAND) {
+    payload[len++] = mqttClient.read();
+  }
+  payload[len] = '\0';
+  if (size > MQTT_MAX_COMMAND || String(door) != id || door < 0 || door >= NUM_DOORS) {
+    Serial.println("MQTT: rejected command");
+    return;
+  }
+
+  String line(payload);
+  int first = line.indexOf(' ');
+  int second = line.indexOf(' ', first + 1);
+  String action = line.substring(0, first);
+  Command cmd = action == "lock" ? LOCK_CMD : action == "unlock" ? UNLOCK_CMD : NONE;
+  String context = "MQTT " + action + ' ' + id + ' ';
+  if (first < 0 || second < 0 || cmd == NONE ||
+      !verifyAuthentication(context, line.substring(first + 1, second),
+                            line.substring(second + 1))) {
+    Serial.println("MQTT: rejected command");
+    return;
+  }
+  Serial.print("MQTT: received ");
+  Serial.println(action);
+  doors[door].pendingCmd = cmd;
+}
+
+/**
+ * Connects to the broker, subscribes to the command topics and queues the
+ * current state of every door, so that the retained states are right even if
+ * changes were dropped while disconnected.
+ *
+ * Input: None
+ *
+ * Output: bool indicating whether the connection succeeded.
+ */
+bool mqttConnect() {
+  mqtt.lastAttemptMs = millis();
+  // The name lookup has no timeout of its own, so it is not in the loop budget:
+  // it gets an attempt to itself, right after a watchdog refresh
+  if (!mqtt.resolved) {
+    watchdogRefresh();
+    mqtt.resolved = WiFi.hostByName(MQTT_BROKER, mqtt.brokerIp) == 1;
+    if (!mqtt.resolved) {
+      Serial.println("MQTT: could not resolve " MQTT_BROKER);
+      mqtt.backoffMs = min(mqtt.backoffMs * 2, MQTT_BACKOFF_MAX);
+    }
+    return false;
+  }
+  mqttNet.setConnectionTimeout(MQTT_CONNECT_TIMEOUT);
+  mqttClient.setId(MQTT_TOPIC);
+#ifdef MQTT_USER
+  mqttClient.setUsernamePassword(MQTT_USER, MQTT_PASS);
+#endif
+  mqttClient.setConnectionTimeout(MQTT_CONNECT_TIMEOUT);
+  mqttClient.setKeepAliveInterval(MQTT_KEEP_ALIVE);
+  mqttClient.onMessage(mqttOnMessage);
+  mqttClient.beginWill(MQTT_TOPIC "/online", true, 1);
+  mqttClient.print("0");
+  mqttClient.endWill();
+
+  if (!mqttClient.connect(mqtt.brokerIp, MQTT_PORT)) {
+    Serial.print("MQTT: connection failed, error ");
+    Serial.println(mqttClient.connectError());
+    // Look the broker up again, in case it moved
+    mqtt.resolved = false;
+    mqtt.backoffMs = min(mqtt.backoffMs * 2, MQTT_BACKOFF_MAX);
+    return false;
+  }
+  mqtt.backoffMs = MQTT_BACKOFF_MIN;
+  mqtt.connects++;
+  Serial.println("MQTT: connected");
+
+  mqttClient.subscribe(MQTT_TOPIC "/doors/+/command", 1);
+  mqttClient.beginMessage(MQTT_TOPIC "/online", true);
+  mqttClient.print("1");
+  mqttClient.endMessage();
+  for (int d = 0; d < NUM_DOORS; d++) {
+    mqttEnqueue(d, doors[d].fsm.currentState);
+  }
+  return true;
+}
+
+/**
+ * Keeps the connection to the broker up, handles incoming commands and
+ * publishes queued state changes. Meant to be called every loop().
+ *
+ * Input: None
+ * Output: None
+ */
+void mqttPoll() {
+  if (!wifiLink.up) return;
+  if (!mqttClient.connected()) {
+    if (millis() - mqtt.lastAttemptMs < mqtt.backoffMs || !mqttConnect()) return;
+  }
+
+  mqttClient.poll();
+  while (mqtt.size > 0 && mqttPublishState(mqtt.queue[mqtt.head])) {
+    mqtt.head = (mqtt.head + 1) % MQTT_QUEUE_LEN;
+    mqtt.size--;
+  }
+}
+
+#else
+
+inline void mqttRecordTransition(const Door& door, State to) {}
+inline void mqttPoll() {}
+
+#endif  // MQTT_BROKER
@@ -4,6 +4,93 @@
 #include <Servo.h>
 #include "utils.h"
 
+/*
+ * Policies that `BasicServo` is put together from. Each one is a small struct
+ * that `BasicServo` inherits from, so that its members are used as if they
+ * were the servo's own.
+ */
+
+// Pins set at runtime (the defaults below unless changed before `init()`)
+struct RuntimePins {
+  int servoPin = 9;
+  int feedbackPin = A0;
+  int transistorPin = 5;
+
+  void assignPins(int servo, int feedback, int transistor) {
+    servoPin = servo;
+    feedbackPin = feedback;
+    transistorPin = transistor;
+  }
+};
+
+// Pins fixed at compile time, so that every use of them is a constant
+template <int ServoPin, int FeedbackPin, int TransistorPin>
+struct FixedPins {
+  static constexpr int servoPin = ServoPin;
+  static constexpr int feedbackPin = FeedbackPin;
+  static constexpr int transistorPin = TransistorPin;
+
+  // Only checks that the pins asked for are the ones compiled in
+  void assignPins(int servo, int feedback, int transistor) {
+    assert(servo == servoPin && feedback == feedbackPin && transistor == transistorPin);
+  }
+};
+
+// Reads the feedback pin with `analogReadStable()`, which drops outliers
+struct StableFilter {
+  static int read(int pin) { return analogReadStable(pin); }
+};
+
+// Reads the feedback pin once; cheaper, for feedback that does not jump
+struct RawFilter {
+  static int read(int pin) { return analogRead(pin); }
+};
+
+// Keeps the calibration as measured and converts a reading with `map()`,
+// which divides every time
+struct MapCalibration {
+  int minDegrees;
+  int maxDegrees;
+  int minFeedback;
+  int maxFeedback;
+  int minPoFeedback;
+  int maxPoFeedback;
+
+  // Called when the values above have been measured
+  void calibrated() {}
+
+  int toDeg(int feedback, bool powered) const {
+    if (powered) {
+      return map(feedback, minFeedback, maxFeedback, minDegrees, maxDegrees);
+    } else {
+      return map(feedback, minPoFeedback, maxPoFeedback, minDegrees, maxDegrees);
+    }
+  }
+};
+
+// Also keeps each conversion (powered and unpowered) as a line in 16.16 fixed
+// point, worked out once per calibration, so that a reading costs a multiply
+// and a shift. Rounds to the nearest degree, where `map()` truncates.
+struct SlopeCalibration : MapCalibration {
+  int32_t slope[2];   // degrees per feedback unit, indexed by whether the motor is powered
+  int32_t offset[2];  // degrees at feedback 0
+
+  void calibrated() {
+    fitLine(0, minPoFeedback, maxPoFeedback);
+    fitLine(1, minFeedback, maxFeedback);
+  }
+
+  int toDeg(int feedback, bool powered) const {
+    return ((int64_t)feedback * slope[powered] + offset[powered]) >> 16;
+  }
+
+ private:
+  void fitLine(int i, int minFb, int maxFb) {
+    slope[i] = maxFb == minFb ? 0 : ((int32_t)(maxDegrees - minDegrees) << 16) / (maxFb - minFb);
+    offset[i] = ((int64_t)minDegrees << 16) - (int64_t)minFb * slope[i] + (1 << 15);
+  }
+};
+
 /**
  * This is a wrapper around the official `Servo` class that provides additional
  * functionality to:
@@ -12,22 +99,47 @@
  *   is powered or not.
  * - calibrate the lock so that the position reading is as precise as possible.
  * - cut the power to the servo motor using a BJT transistor.
+ *
+ * Where its pins come from (`Pins`), how the feedback pin is read (`Filter`)
+ * and how the calibration turns a reading into degrees (`Calibration`) are
+ * template parameters; with `FixedPins` and `SlopeCalibration`, `deg()`
+ * compiles down to constant pin accesses and one multiply. `MyServo` is the
+ * fully runtime-configured form.
  */
-struct MyServo {
-  int servoPin = 9;
-  int feedbackPin = A0;
-  int transistorPin = 5;
+template <typename Pins, typename Filter, typename Calibration>
+struct BasicServo : Pins, Calibration {
+  using Pins::servoPin;
+  using Pins::feedbackPin;
+  using Pins::transistorPin;
+  using Calibration::minDegrees;
+  using Calibration::maxDegrees;
+  using Calibration::minFeedback;
+  using Calibration::maxFeedback;
+  using Calibration::minPoFeedback;
+  using Calibration::maxPoFeedback;
+
   Servo servo;
   bool attached = false;
-  int minDegrees;
-  int maxDegrees;
-  int minFeedback;
-  int maxFeedback;
-  int minPoFeedback;
-  int maxPoFeedback;
 
-  MyServo(int servoPin, int feedbackPin, int transistorPin)
-      : servoPin(servoPin), feedbackPin(feedbackPin), transistorPin(transistorPin) {}
+  // Progress of a calibration started with `beginCalibration()`
+  enum CalibrationStep {
+    CAL_IDLE,
+    CAL_MIN_MOVING,
+    CAL_MIN_SETTLING,
+    CAL_MAX_MOVING,
+    CAL_MAX_SETTLING
+  };
+  CalibrationStep calStep = CAL_IDLE;
+  unsigned long calStepStart;
+  int calMaxPos;
+  bool calPrevAttached;
+
+  // Uses the default pins of `Pins`; runtime pins can be changed before calling `init()`.
+  BasicServo() {}
+
+  // Only for `RuntimePins`
+  BasicServo(int servoPin, int feedbackPin, int transistorPin)
+      : Pins{servoPin, feedbackPin, transistorPin} {}
 
   /**
    * This function initializes the necessary hardware so that the transistor pin can output signals
@@ -114,13 +226,83 @@ struct MyServo {
    * Output: Integer value representing the current motor's position, in degrees
    * 
    */
-  int deg() {
-    int feedback = analogReadStable(feedbackPin);
-    if (attached) {
-      return map(feedback, minFeedback, maxFeedback, minDegrees, maxDegrees);
-    } else {
-      return map(feedback, minPoFeedback, maxPoFeedback, minDegrees, maxDegrees);
+  int deg() { return Calibration::toDeg(Filter::read(feedbackPin), attached); }
+
+  /**
+   * This function starts calibrating the servo motor without waiting for it to finish; the calibration is
+   * completed by calling `calibrationStep()` until it returns true. This lets the caller do other work (e.g.
+   * connecting to WiFi) while the motor travels and settles. See `calibrate()` for what is being measured.
+   *
+   * Input:
+   *  - minPos (int) : The min position of the servo motor in degrees, represented by an int
+   *  - maxPos (int) : The max position of the servo motor in degrees, represented by an int
+   *
+   * Output: None
+   *
+   * Side Effect: Servo motor starts moving to `minPos`
+   */
+  void beginCalibration(int minPos, int maxPos) {
+    Serial.print("Calibrating with minPos=");
+    Serial.print(minPos);
+    Serial.print(", maxPos=");
+    Serial.println(maxPos);
+
+    calPrevAttached = attached;
+    calMaxPos = maxPos;
+
+    // Move to the minimum position
+    attachAndWrite(minPos);
+    minDegrees = minPos;
+    calStep = CAL_MIN_MOVING;
+    calStepStart = millis();
+  }
+
+  /**
+   * This function advances a calibration started by `beginCalibration()` as far as the elapsed time allows. It
+   * never blocks; each step only records a feedback value once the motor has had enough time to get there and
+   * settle, so calling it late only makes the calibration take longer.
+   *
+   * Input: None
+   *
+   * Output: bool indicating whether the calibration is finished
+   *
+   * Side Effect: Servo motor is moved and the feedback values are recorded as the calibration progresses
+   */
+  bool calibrationStep() {
+    unsigned long elapsed = millis() - calStepStart;
+    switch (calStep) {
+      case CAL_IDLE:
+        return true;
+      case CAL_MIN_MOVING:
+        if (elapsed < 2000) return false;  // make sure it has time to get there and settle
+        minFeedback = analogReadStable(feedbackPin);
+        detach();
+        calStep = CAL_MIN_SETTLING;
+        break;
+      case CAL_MIN_SETTLING:
+        if (elapsed < 500) return false;
+        minPoFeedback = analogReadStable(feedbackPin);
+        // Move to the maximum position
+        attachAndWrite(calMaxPos);
+        maxDegrees = calMaxPos;
+        calStep = CAL_MAX_MOVING;
+        break;
+      case CAL_MAX_MOVING:
+        if (elapsed < 2000) return false;  // make sure it has time to get there and settle
+        maxFeedback = analogReadStable(feedbackPin);
+        detach();
+        calStep = CAL_MAX_SETTLING;
+        break;
+      case CAL_MAX_SETTLING:
+        if (elapsed < 500) return false;
+        maxPoFeedback = analogReadStable(feedbackPin);
+        Calibration::calibrated();
+        if (calPrevAttached) attach();
+        calStep = CAL_IDLE;
+        return true;
     }
+    calStepStart = millis();
+    return false;
   }
 
   /**
@@ -138,31 +320,12 @@ struct MyServo {
    * 
    */
   void calibrate(int minPos, int maxPos) {
-    Serial.print("Calibrating with minPos=");
-    Serial.print(minPos);
-    Serial.print(", maxPos=");
-    Serial.println(maxPos);
-
-    bool prevAttached = attached;
-
-    // Move to the minimum position and record the feedback value
-    attachAndWrite(minPos);
-    minDegrees = minPos;
-    delay(2000);  // make sure it has time to get there and settle
-    minFeedback = analogReadStable(feedbackPin);
-    detach();
-    delay(500);
-    minPoFeedback = analogReadStable(feedbackPin);
-
-    // Move to the maximum position and record the feedback value
-    attachAndWrite(maxPos);
-    maxDegrees = maxPos;
-    delay(2000);  // make sure it has time to get there and settle
-    maxFeedback = analogReadStable(feedbackPin);
-    detach();
-    delay(500);
-    maxPoFeedback = analogReadStable(feedbackPin);
-
-    if (prevAttached) attach();
+    beginCalibration(minPos, maxPos);
+    while (!calibrationStep()) {
+      delay(10);
+    }
   }
 };
+
+// The runtime-configured servo: pins set at runtime, stable reads and `map()`
+using MyServo = BasicServo<RuntimePins, StableFilter, MapCalibration>;
@@ -0,0 +1,215 @@
+/*
+ * PER-PHASE LOOP PROFILER
+ *
+ * Measures how long each phase of `loop()` takes using the DWT cycle counter
+ * of the Cortex-M4 in the RA4M1, or `std::chrono` when compiled for a host.
+ * For every phase it keeps the min/max/mean and a log2 histogram of the
+ * duration in ticks (CPU cycles on the board, nanoseconds on a host).
+ *
+ * Profiling is only compiled in when `PROFILE_LOOP` is defined in config.h;
+ * otherwise the `PROFILE_*` macros expand to nothing.
+ */
+
+#pragma once
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <chrono>
+#include <cstdint>
+#endif
+
+// The phases of `loop()`. PHASE_AUTH happens inside PHASE_PARSE, so the time
+// of the latter includes the former.
+enum Phase {
+  PHASE_ACCEPT,
+  PHASE_PARSE,
+  PHASE_AUTH,
+  PHASE_DEG,
+  PHASE_FSM,
+  PHASE_RESPOND,
+  PHASE_DISPLAY,
+  PHASE_WIFI,
+  PHASE_WATCHDOG,
+  NUM_PHASES
+};
+
+const char* phaseToString(Phase phase) {
+  switch (phase) {
+    case PHASE_ACCEPT:
+      return "accept";
+    case PHASE_PARSE:
+      return "getTopRequest";
+    case PHASE_AUTH:
+      return "verifyAuthentication";
+    case PHASE_DEG:
+      return "deg";
+    case PHASE_FSM:
+      return "fsmTransition";
+    case PHASE_RESPOND:
+      return "respondRequest";
+    case PHASE_DISPLAY:
+      return "display";
+    case PHASE_WIFI:
+      return "wifi";
+    case PHASE_WATCHDOG:
+      return "watchdog";
+    default:
+      return "unknown";
+  }
+}
+
+#ifdef PROFILE_LOOP
+
+// Number of log2 buckets: bucket i counts durations in [2^(i-1), 2^i) ticks,
+// bucket 0 counts zero-tick durations.
+const int PROFILE_BUCKETS = 33;
+
+struct PhaseStats {
+  uint32_t min;
+  uint32_t max;
+  uint64_t sum;
+  uint32_t count;
+  uint32_t buckets[PROFILE_BUCKETS];
+};
+
+PhaseStats phaseStats[NUM_PHASES];
+
+/**
+ * Starts the tick counter. Must be called once in `setup()` before any phase
+ * is profiled.
+ *
+ * Input: None
+ * Output: None
+ */
+void profilerBegin() {
+#ifdef ARDUINO
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+  for (int i = 0; i < NUM_PHASES; i++) {
+    phaseStats[i] = PhaseStats{UINT32_MAX, 0, 0, 0, {}};
+  }
+}
+
+/**
+ * Returns the current value of the tick counter. It wraps around, so only the
+ * (unsigned) difference between two readings is meaningful.
+ */
+inline uint32_t profilerNow() {
+#ifdef ARDUINO
+  return DWT->CYCCNT;
+#else
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+/**
+ * Records that `phase` took `ticks` ticks.
+ *
+ * Input:
+ *  - phase (Phase): the phase that was measured.
+ *  - ticks (uint32_t): how long the phase took.
+ *
+ * Output: None
+ */
+inline void profilerRecord(Phase phase, uint32_t ticks) {
+  PhaseStats& st = phaseStats[phase];
+  if (ticks < st.min) st.min = ticks;
+  if (ticks > st.max) st.max = ticks;
+  st.sum += ticks;
+  st.count++;
+  st.buckets[ticks == 0 ? 0 : 32 - __builtin_clz(ticks)]++;
+}
+
+// Records the time from its construction to the end of the enclosing scope.
+struct PhaseScope {
+  Phase phase;
+  uint32_t start;
+  PhaseScope(Phase phase) : phase(phase), start(profilerNow()) {}
+  ~PhaseScope() { profilerRecord(phase, profilerNow() - start); }
+};
+
+// Writes the shortest (or longest) duration of each phase as a gauge family.
+void writePhaseExtreme(Print& out, const char* family, const char* help, bool max) {
+  out.print("# HELP ");
+  out.print(family);
+  out.print(' ');
+  out.println(help);
+  out.print("# TYPE ");
+  out.print(family);
+  out.println(" gauge");
+  for (int p = 0; p < NUM_PHASES; p++) {
+    const PhaseStats& st = phaseStats[p];
+    if (st.count == 0) continue;
+    out.print(family);
+    out.print("{phase=\"");
+    out.print(phaseToString((Phase)p));
+    out.print("\"} ");
+    out.println(max ? st.max : st.min);
+  }
+}
+
+/**
+ * Writes the per-phase statistics in the Prometheus text format, so that they
+ * are part of the `GET /metrics` output. Empty histogram buckets are skipped.
+ *
+ * Input:
+ *  - out (Print&): where to write the statistics.
+ *
+ * Output: None
+ */
+void writeProfile(Print& out) {
+  out.println("# HELP doorlock_phase_ticks Duration of each loop() phase, in ticks.");
+  out.println("# TYPE doorlock_phase_ticks histogram");
+  for (int p = 0; p < NUM_PHASES; p++) {
+    const PhaseStats& st = phaseStats[p];
+    if (st.count == 0) continue;
+    const char* name = phaseToString((Phase)p);
+
+    uint32_t cumulative = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+      if (st.buckets[b] == 0) continue;
+      cumulative += st.buckets[b];
+      out.print("doorlock_phase_ticks_bucket{phase=\"");
+      out.print(name);
+      out.print("\",le=\"");
+      out.print(b == 0 ? 0 : (1ULL << b) - 1);
+      out.print("\"} ");
+      out.println(cumulative);
+    }
+    out.print("doorlock_phase_ticks_bucket{phase=\"");
+    out.print(name);
+    out.print("\",le=\"+Inf\"} ");
+    out.println(st.count);
+    out.print("doorlock_phase_ticks_sum{phase=\"");
+    out.print(name);
+    out.print("\"} ");
+    out.println(st.sum);
+    out.print("doorlock_phase_ticks_count{phase=\"");
+    out.print(name);
+    out.print("\"} ");
+    out.println(st.count);
+  }
+
+  // Each metric family must be contiguous, so the extremes follow the histogram
+  writePhaseExtreme(out, "doorlock_phase_ticks_min",
+                    "Shortest duration of each loop() phase, in ticks.", false);
+  writePhaseExtreme(out, "doorlock_phase_ticks_max",
+                    "Longest duration of each loop() phase, in ticks.", true);
+}
+
+#define PROFILE_BEGIN(phase) uint32_t profileStart_##phase = profilerNow()
+#define PROFILE_END(phase) profilerRecord(phase, profilerNow() - profileStart_##phase)
+#define PROFILE_SCOPE(phase) PhaseScope profileScope_##phase(phase)
+
+#else
+
+#define PROFILE_BEGIN(phase)
+#define PROFILE_END(phase)
+#define PROFILE_SCOPE(phase)
+
+#endif  // PROFILE_LOOP
@@ -0,0 +1,266 @@
+/*
+ * FSM INPUT RECORDER
+ *
+ * Records the inputs of every `fsmTransition()` call (door, position, time,
+ * button and command) in a ring buffer, so that a misbehaving lock can be
+ * reproduced after the fact. The ring lives in `.noinit` RAM, like the
+ * watchdog breadcrumbs, and is persisted to the EEPROM (data flash):
+ *  - when a door goes to BAD, a few records per loop() so that the flash
+ *    writes never stall the loop; recording pauses until it is done,
+ *  - at the next boot after a watchdog reset, before the watchdog is armed.
+ *
+ * Calls that leave the FSM unchanged (no transition, command or button) are
+ * coalesced with the previous such call of the same door, since replaying
+ * either one makes the same (empty) decision; this keeps hours of an idle
+ * lock from flushing out the interesting part.
+ *
+ * Every record also holds the door's state before the call, so a replay can
+ * start at any record and check after each call that the FSM took the same
+ * path. The UNIT_TEST build replays the stored recording through the same
+ * `fsmTransition()` after the unit tests; flashing it onto the board that
+ * misbehaved keeps the data flash, and with it the recording. GET /replay
+ * downloads the raw recording.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "utils.h"
+
+// Note: State, Command, FSMState, doors, NUM_DOORS, ResetCause, TOL,
+// ANGLE_TOLERANCE and EEPROM_REPLAY_ADDR must be defined in doorlock.ino
+// before this header is included.
+
+// Number of calls kept; a power of two so that the ring index is a mask
+const int REPLAY_LEN = 256;
+static_assert((REPLAY_LEN & (REPLAY_LEN - 1)) == 0, "REPLAY_LEN must be a power of two");
+// Records written to the EEPROM per loop() while persisting
+const int REPLAY_PERSIST_BATCH = 8;
+
+// Changes whenever the layout of a persisted recording does
+const uint32_t REPLAY_MAGIC = 0xD00B5EEE;
+
+const uint8_t REPLAY_BUTTON = 0x80;  // flag in ReplayInput::flags; the low bits are the Command
+
+// Why a recording was persisted
+enum ReplayReason : uint8_t { REPLAY_BAD, REPLAY_WATCHDOG };
+
+// One fsmTransition() call
+struct ReplayInput {
+  uint32_t ms;
+  int16_t deg;
+  uint8_t doorState;  // door << 4 | the door's state before the call
+  uint8_t flags;      // REPLAY_BUTTON | Command
+};
+static_assert(sizeof(ReplayInput) == 8, "replay inputs must be 8 bytes");
+
+// What a replay needs to know about a door besides its inputs
+struct ReplayDoor {
+  int16_t lockDeg;
+  int16_t unlockDeg;
+  uint8_t state;    // state after the door's newest record
+  uint8_t reserved[3];
+  uint32_t newest;  // 1 + the record number of the door's newest record, or 0 if none
+};
+
+struct ReplayRecorder {
+  uint32_t magic;
+  uint32_t count;  // calls recorded; the newest is at (count - 1) % REPLAY_LEN
+  ReplayDoor doors[NUM_DOORS];
+  ReplayInput inputs[REPLAY_LEN];
+};
+
+// Lives in `.noinit`, so it survives a watchdog reset (but not a power cycle).
+ReplayRecorder replayRecorder __attribute__((section(".noinit")));
+
+// Layout of a persisted recording: this header at EEPROM_REPLAY_ADDR, followed
+// by `numInputs` ReplayInputs, oldest first
+struct ReplayDumpHeader {
+  uint32_t magic;
+  uint8_t reason;  // ReplayReason
+  uint8_t numDoors;
+  uint16_t numInputs;
+  ReplayDoor doors[NUM_DOORS];
+  // The tunables fsmTransition() decides with, as they were while recording
+  uint32_t moveTimeoutMs;   // TOL
+  int32_t angleTolerance;   // ANGLE_TOLERANCE
+  uint32_t crc;  // CRC-32 of the inputs and the header fields above
+};
+
+static_assert(EEPROM_REPLAY_ADDR + sizeof(ReplayDumpHeader) + REPLAY_LEN * sizeof(ReplayInput) <=
+                  EEPROM_SCHEDULE_ADDR,
+              "the persisted FSM input recording overlaps the scheduled commands");
+
+struct ReplayPersist {
+  bool active;
+  uint32_t first;  // record number of the oldest input being persisted
+  uint16_t next;   // inputs written so far
+  ReplayDumpHeader header;
+};
+
+ReplayPersist replayPersist;
+
+inline int replayInputAddr(int i) {
+  return EEPROM_REPLAY_ADDR + sizeof(ReplayDumpHeader) + i * sizeof(ReplayInput);
+}
+
+/**
+ * Starts persisting the recording. Recording pauses until
+ * `replayPersistStep()` has written all of it.
+ *
+ * Input:
+ *  - reason (ReplayReason): why the recording is persisted.
+ *
+ * Output: None
+ */
+void replayPersistBegin(ReplayReason reason) {
+  ReplayDumpHeader& header = replayPersist.header;
+  uint32_t count = replayRecorder.count;
+  header.magic = REPLAY_MAGIC;
+  header.reason = reason;
+  header.numDoors = NUM_DOORS;
+  header.numInputs = min(count, (uint32_t)REPLAY_LEN);
+  memcpy(header.doors, replayRecorder.doors, sizeof(header.doors));
+  header.moveTimeoutMs = TOL;
+  header.angleTolerance = ANGLE_TOLERANCE;
+  header.crc = 0;
+
+  replayPersist.first = count - header.numInputs;
+  replayPersist.next = 0;
+  replayPersist.active = true;
+  // Invalidate the old recording first, so a power loss midway leaves none
+  // rather than a mix of both
+  EEPROM.put(EEPROM_REPLAY_ADDR, (uint32_t)0);
+}
+
+/**
+ * Writes the next `REPLAY_PERSIST_BATCH` inputs of a recording being
+ * persisted, and the header once they are all written. Meant to be called
+ * every loop().
+ *
+ * Input: None
+ * Output: None
+ */
+void replayPersistStep() {
+  if (!replayPersist.active) return;
+  ReplayDumpHeader& header = replayPersist.header;
+  for (int n = 0; n < REPLAY_PERSIST_BATCH && replayPersist.next < header.numInputs; n++) {
+    uint32_t seq = replayPersist.first + replayPersist.next;
+    const ReplayInput& input = replayRecorder.inputs[seq & (REPLAY_LEN - 1)];
+    header.crc = crc32(&input, sizeof(input), header.crc);
+    EEPROM.put(replayInputAddr(replayPersist.next), input);
+    replayPersist.next++;
+  }
+  if (replayPersist.next == header.numInputs) {
+    header.crc = crc32(&header, offsetof(ReplayDumpHeader, crc), header.crc);
+    EEPROM.put(EEPROM_REPLAY_ADDR, header);
+    replayPersist.active = false;
+    Serial.print("Replay: persisted ");
+    Serial.print(header.numInputs);
+    Serial.println(" FSM inputs");
+  }
+}
+
+/**
+ * Persists the recording of the previous boot if it ended in a watchdog
+ * reset, then starts a new recording. Must be called at boot before the first
+ * `fsmTransition()` and before the watchdog is armed, since it writes the
+ * whole recording at once.
+ *
+ * Input:
+ *  - cause (ResetCause): why the board last reset.
+ *
+ * Output: None
+ */
+void replayBegin(ResetCause cause) {
+  if (cause == RESET_WATCHDOG && replayRecorder.magic == REPLAY_MAGIC) {
+    replayPersistBegin(REPLAY_WATCHDOG);
+    while (replayPersist.active) {
+      replayPersistStep();
+    }
+  }
+  memset(&replayRecorder, 0, sizeof(replayRecorder));
+  replayRecorder.magic = REPLAY_MAGIC;
+}
+
+/**
+ * Records one `fsmTransition()` call; called by it after every call. Starts
+ * persisting the recording when a door goes to BAD.
+ *
+ * Input:
+ *  - door (int): the door the call was for.
+ *  - fsm (const FSMState&): its FSM after the call.
+ *  - from (State): its state before the call.
+ *  - deg (int), ms (unsigned long), button (bool), cmd (Command): the inputs
+ *    of the call.
+ *
+ * Output: None
+ */
+void replayRecord(int door, const FSMState& fsm, State from, int deg, unsigned long ms, bool button,
+                  Command cmd) {
+  if (replayPersist.active || replayRecorder.magic != REPLAY_MAGIC) return;
+
+  ReplayDoor& rd = replayRecorder.doors[door];
+  bool noop = fsm.currentState == from && cmd == NONE && !button;
+  uint32_t seq = replayRecorder.count;
+  if (noop && rd.newest != 0 && seq - rd.newest < REPLAY_LEN) {
+    // The door's newest record is still in the ring; coalesce with it if it
+    // was a no-op in the same state too
+    const ReplayInput& prev = replayRecorder.inputs[(rd.newest - 1) & (REPLAY_LEN - 1)];
+    if ((prev.doorState & 0xF) == from && prev.flags == NONE) seq = rd.newest - 1;
+  }
+
+  ReplayInput& input = replayRecorder.inputs[seq & (REPLAY_LEN - 1)];
+  input.ms = ms;
+  input.deg = deg;
+  input.doorState = door << 4 | from;
+  input.flags = (button ? REPLAY_BUTTON : 0) | cmd;
+  if (seq == replayRecorder.count) replayRecorder.count++;
+
+  rd.lockDeg = fsm.lockDeg;
+  rd.unlockDeg = fsm.unlockDeg;
+  rd.state = fsm.currentState;
+  rd.newest = seq + 1;
+
+  if (fsm.currentState == BAD && from != BAD) {
+    replayPersistBegin(REPLAY_BAD);
+  }
+}
+
+/**
+ * Reads the persisted recording's header and checks the recording against its
+ * CRC.
+ *
+ * Output: bool indicating whether a complete recording is stored.
+ */
+bool replayReadHeader(ReplayDumpHeader& header) {
+  EEPROM.get(EEPROM_REPLAY_ADDR, header);
+  if (header.magic != REPLAY_MAGIC || header.numDoors != NUM_DOORS ||
+      header.numInputs > REPLAY_LEN) {
+    return false;
+  }
+  uint32_t crc = 0;
+  for (int i = 0; i < header.numInputs; i++) {
+    ReplayInput input;
+    EEPROM.get(replayInputAddr(i), input);
+    crc = crc32(&input, sizeof(input), crc);
+  }
+  return crc32(&header, offsetof(ReplayDumpHeader, crc), crc) == header.crc;
+}
+
+/**
+ * Writes the persisted recording, header and inputs, as stored.
+ *
+ * Input:
+ *  - out (Print&): where to write it.
+ *  - header (const ReplayDumpHeader&): its header, checked by `replayReadHeader()`.
+ *
+ * Output: None
+ */
+void writeReplayDump(Print& out, const ReplayDumpHeader& header) {
+  int len = replayInputAddr(header.numInputs) - EEPROM_REPLAY_ADDR;
+  for (int i = 0; i < len; i++) {
+    out.write(EEPROM.read(EEPROM_REPLAY_ADDR + i));
+  }
+}
@@ -0,0 +1,107 @@
+/*
+ * PER-REQUEST TIMING
+ *
+ * Breaks the time spent on each HTTP request down into parsing, HMAC
+ * verification, the EEPROM write of its nonce and the FSM tick, and hands the
+ * breakdown back to the client in a `Server-Timing` header together with an
+ * `X-Request-Id`, so slow requests can be diagnosed from the app. A response
+ * cannot contain the time it takes to write itself, so that time is only
+ * exported as a histogram in /metrics.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+struct RequestTiming {
+  uint32_t bootId;         // random per boot, so IDs do not repeat across reboots
+  uint32_t seq;            // number of requests handled since boot
+  unsigned long parseUs;         // getTopRequest(), including auth
+  unsigned long authUs;          // verifyAuthStream(), including the nonce persist
+  unsigned long noncePersistUs;  // EEPROM write of the nonce's timestamp
+  unsigned long fsmUs;           // fsmTransition()
+};
+
+RequestTiming requestTiming;
+
+// Adds the time from its construction to the end of the enclosing scope to
+// `total`.
+struct MicrosScope {
+  unsigned long& total;
+  unsigned long start;
+  MicrosScope(unsigned long& total) : total(total), start(micros()) {}
+  ~MicrosScope() { total += micros() - start; }
+};
+
+/**
+ * Picks the boot ID. Should be called once in `setup()`, after something with
+ * a variable duration (e.g. connecting to WiFi) so that `micros()` differs
+ * between boots.
+ *
+ * Input: None
+ * Output: None
+ */
+void requestTimingBegin() {
+  randomSeed(micros() ^ analogRead(A1));
+  requestTiming.bootId = random(0x7FFFFFFF);
+}
+
+/**
+ * Clears the durations of the previous request and assigns the next request
+ * ID.
+ *
+ * Input: None
+ * Output: None
+ */
+void requestTimingNext() {
+  requestTiming.seq++;
+  requestTiming.parseUs = 0;
+  requestTiming.authUs = 0;
+  requestTiming.noncePersistUs = 0;
+  requestTiming.fsmUs = 0;
+}
+
+/**
+ * Prints a duration given in microseconds as milliseconds with three decimals,
+ * which is the unit `Server-Timing` uses, without losing any precision.
+ */
+void printMicrosAsMillis(Print& out, unsigned long us) {
+  unsigned long frac = us % 1000;
+  out.print(us / 1000);
+  out.print(".");
+  if (frac < 100) out.print("0");
+  if (frac < 10) out.print("0");
+  out.print(frac);
+}
+
+/**
+ * Writes the `X-Request-Id` and `Server-Timing` headers of the current
+ * request. Durations are measured in microseconds and written in milliseconds
+ * as the header requires. The reported durations do not overlap: parse
+ * excludes auth, and auth excludes nonce_persist. The other EEPROM writes a
+ * request may cause (journal, schedule, replay) are not reported.
+ *
+ * Input:
+ *  - out (Print&): where the response headers are written.
+ *
+ * Output: None
+ */
+void writeRequestTimingHeaders(Print& out) {
+  out.print("X-Request-Id: ");
+  out.print(requestTiming.bootId, HEX);
+  out.print("-");
+  out.println(requestTiming.seq);
+
+  out.print("Server-Timing: parse;dur=");
+  printMicrosAsMillis(out, requestTiming.parseUs - requestTiming.authUs);
+  out.print(", auth;dur=");
+  printMicrosAsMillis(out, requestTiming.authUs - requestTiming.noncePersistUs);
+  out.print(", nonce_persist;dur=");
+  printMicrosAsMillis(out, requestTiming.noncePersistUs);
+  out.print(", fsm;dur=");
+  printMicrosAsMillis(out, requestTiming.fsmUs);
+  out.println();
+
+  // Browsers hide non-CORS-safelisted headers from scripts unless told otherwise
+  out.println("Access-Control-Expose-Headers: Server-Timing, X-Request-Id");
+}
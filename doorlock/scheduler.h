@@ -0,0 +1,313 @@
+/*
+ * COMMAND SCHEDULER
+ *
+ * Runs lock and unlock commands later without the client: the relock after
+ * `POST /unlock?relock_after=<seconds>`, and recurring commands set up with
+ * `POST /lock?every=<seconds>` or `POST /unlock?every=<seconds>`. A due
+ * command is handed to its door's next tick like any other pending command.
+ *
+ * Timers sit in a hashed timer wheel of `SCHEDULE_SLOTS` one-second slots:
+ * adding a timer links it into the slot it is due in (with the number of laps
+ * of the wheel it still has to wait), and every second loop() only visits the
+ * timers of one slot, so neither depends on how many timers there are.
+ *
+ * Timers are persisted in the EEPROM and rearmed at boot. Their due times are
+ * kept on the journal's clock (see journal.h), which does not count the time
+ * the lock was off, so a relock pending at a reset runs at most its remaining
+ * delay after the boot and is never lost.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "utils.h"
+
+// Note: doors, NUM_DOORS, State, Command, Request, RequestParams, journalNow()
+// and EEPROM_SCHEDULE_ADDR must be defined in doorlock.ino before this header
+// is included.
+
+// Slots in the wheel; a timer due further out waits whole laps
+const int SCHEDULE_SLOTS = 64;
+// Timers that can be pending at once
+const int SCHEDULE_TIMERS = 8;
+// Delay before retrying a command whose door is moving (seconds)
+const unsigned long SCHEDULE_RETRY = 5;
+// Longest delay or period accepted (seconds): 30 days, well within the laps a
+// timer can wait and the range of its anchor
+const unsigned long SCHEDULE_MAX_DELAY = 30UL * 24 * 3600;
+// Shortest period of a recurring command (seconds)
+const unsigned long SCHEDULE_MIN_EVERY = 60;
+static_assert((SCHEDULE_MAX_DELAY - 1) / SCHEDULE_SLOTS < 0xFFFF,
+              "SCHEDULE_MAX_DELAY must fit in the laps of a timer");
+
+// A timer as stored in the EEPROM
+struct ScheduleEntry {
+  uint8_t used;
+  uint8_t door;
+  uint8_t cmd;  // Command
+  uint8_t crc;  // low byte of the CRC-32 of the other fields
+  uint32_t anchor;  // journal time of the first run
+  uint32_t every;   // period of a recurring command (seconds), or 0 for a single one
+};
+
+struct ScheduleTimer {
+  ScheduleEntry entry;
+  uint16_t rounds;  // laps of the wheel left before it is due
+  uint8_t slot;
+  int8_t next;  // next timer in the same slot, or -1
+};
+
+struct Schedule {
+  ScheduleTimer timers[SCHEDULE_TIMERS];
+  int8_t slots[SCHEDULE_SLOTS];  // first timer due in each slot, or -1
+  uint8_t cursor;                // slot of the current second
+  unsigned long lastTickMs;
+};
+
+Schedule schedule;
+
+inline int scheduleEntryAddr(int i) { return EEPROM_SCHEDULE_ADDR + i * sizeof(ScheduleEntry); }
+
+inline uint8_t scheduleCrc(const ScheduleEntry& e) {
+  uint32_t crc = crc32(&e, offsetof(ScheduleEntry, crc));
+  return crc32(&e.anchor, sizeof(e) - offsetof(ScheduleEntry, anchor), crc) & 0xFF;
+}
+
+void schedulePersist(int i) {
+  ScheduleEntry& e = schedule.timers[i].entry;
+  e.crc = scheduleCrc(e);
+  EEPROM.put(scheduleEntryAddr(i), e);
+}
+
+/**
+ * Links timer `i` into the wheel, due `delay` seconds from now (at least one).
+ */
+void scheduleInsert(int i, unsigned long delay) {
+  delay = max(delay, 1UL);
+  ScheduleTimer& t = schedule.timers[i];
+  t.slot = (schedule.cursor + delay) % SCHEDULE_SLOTS;
+  t.rounds = min((delay - 1) / SCHEDULE_SLOTS, 0xFFFFUL);
+  t.next = schedule.slots[t.slot];
+  schedule.slots[t.slot] = i;
+}
+
+/**
+ * Unlinks timer `i` from the wheel.
+ */
+void scheduleUnlink(int i) {
+  int8_t* link = &schedule.slots[schedule.timers[i].slot];
+  while (*link != i) {
+    link = &schedule.timers[*link].next;
+  }
+  *link = schedule.timers[i].next;
+}
+
+/**
+ * Schedules `cmd` for door `door` in `delay` seconds, and then every `every`
+ * seconds if that is not 0. Replaces the timer already set for the same door
+ * and command, if any.
+ *
+ * Input:
+ *  - door (int): the door to command.
+ *  - cmd (Command): the command.
+ *  - delay (unsigned long): seconds until the first run.
+ *  - every (unsigned long): seconds between runs, or 0 to run once.
+ *
+ * Output: bool indicating whether the timer was set; false if all
+ * `SCHEDULE_TIMERS` are in use.
+ */
+bool scheduleAdd(int door, Command cmd, unsigned long delay, unsigned long every) {
+  int idx = -1;
+  for (int i = 0; i < SCHEDULE_TIMERS; i++) {
+    ScheduleEntry& e = schedule.timers[i].entry;
+    if (e.used && e.door == door && e.cmd == cmd) {
+      scheduleUnlink(i);
+      idx = i;
+      break;
+    }
+    if (!e.used && idx < 0) idx = i;
+  }
+  if (idx < 0) return false;
+
+  ScheduleEntry& e = schedule.timers[idx].entry;
+  e = ScheduleEntry{1, (uint8_t)door, (uint8_t)cmd, 0, (uint32_t)(journalNow() + delay),
+                    (uint32_t)every};
+  schedulePersist(idx);
+  scheduleInsert(idx, delay);
+  return true;
+}
+
+/**
+ * Cancels every timer.
+ *
+ * Input: None
+ * Output: None
+ */
+void scheduleClear() {
+  for (int i = 0; i < SCHEDULE_TIMERS; i++) {
+    if (!schedule.timers[i].entry.used) continue;
+    scheduleUnlink(i);
+    schedule.timers[i].entry.used = 0;
+    schedulePersist(i);
+  }
+}
+
+/**
+ * Runs timer `i`, which is due and already unlinked: gives its command to its
+ * door, or retries shortly if the door is moving. Rearms a recurring timer
+ * and frees a single one.
+ */
+void scheduleFire(int i) {
+  ScheduleEntry& e = schedule.timers[i].entry;
+  Door& door = doors[e.door];
+  State st = door.fsm.currentState;
+  if (st == BUSY_MOVE || st == BUSY_WAIT) {
+    scheduleInsert(i, SCHEDULE_RETRY);
+    return;
+  }
+
+  Serial.print("Schedule: ");
+  Serial.print(e.cmd == LOCK_CMD ? "lock" : "unlock");
+  Serial.print(" door ");
+  Serial.println(e.door);
+  door.pendingCmd = (Command)e.cmd;
+  if (e.every > 0) {
+    scheduleInsert(i, e.every);
+  } else {
+    e.used = 0;
+    schedulePersist(i);
+  }
+}
+
+/**
+ * Advances the wheel by the seconds elapsed since the last call and runs the
+ * timers that became due. Meant to be called every loop(), before the doors
+ * are ticked.
+ *
+ * Input: None
+ * Output: None
+ */
+void scheduleTick() {
+  while (millis() - schedule.lastTickMs >= 1000) {
+    schedule.lastTickMs += 1000;
+    schedule.cursor = (schedule.cursor + 1) % SCHEDULE_SLOTS;
+
+    // Unlink the due timers first, since running them may link them back
+    // into this slot
+    int8_t due = -1;
+    int8_t* link = &schedule.slots[schedule.cursor];
+    while (*link >= 0) {
+      ScheduleTimer& t = schedule.timers[*link];
+      if (t.rounds > 0) {
+        t.rounds--;
+        link = &t.next;
+        continue;
+      }
+      int8_t i = *link;
+      *link = t.next;
+      t.next = due;
+      due = i;
+    }
+    while (due >= 0) {
+      int8_t i = due;
+      due = schedule.timers[i].next;
+      scheduleFire(i);
+    }
+  }
+}
+
+/**
+ * Loads the persisted timers and links them into the wheel. A recurring
+ * timer skips the runs it missed. Must be called once at boot, after
+ * `journalBegin()`.
+ *
+ * Input: None
+ * Output: None
+ */
+void scheduleBegin() {
+  memset(schedule.slots, -1, sizeof(schedule.slots));
+  schedule.cursor = 0;
+  schedule.lastTickMs = millis();
+
+  unsigned long now = journalNow();
+  for (int i = 0; i < SCHEDULE_TIMERS; i++) {
+    ScheduleEntry& e = schedule.timers[i].entry;
+    EEPROM.get(scheduleEntryAddr(i), e);
+    if (!e.used || e.crc != scheduleCrc(e) || e.door >= NUM_DOORS ||
+        (e.cmd != LOCK_CMD && e.cmd != UNLOCK_CMD)) {
+      e.used = 0;
+      continue;
+    }
+    unsigned long delay = 0;
+    if (e.anchor > now) {
+      delay = e.anchor - now;
+    } else if (e.every > 0) {
+      delay = e.every - (now - e.anchor) % e.every;
+    }
+    scheduleInsert(i, delay);
+  }
+}
+
+/**
+ * Returns whether the `relock_after` and `every` parameters of a lock or
+ * unlock request are in range; 0 means the parameter is absent.
+ */
+bool scheduleParamsValid(const RequestParams& params) {
+  return params.relockAfter <= SCHEDULE_MAX_DELAY &&
+         (params.every == 0 ||
+          (params.every >= SCHEDULE_MIN_EVERY && params.every <= SCHEDULE_MAX_DELAY));
+}
+
+/**
+ * Sets the timers asked for by a lock or unlock request (`relock_after`,
+ * `every`) once the request's command has been accepted by its door, and
+ * clears them on POST /schedule/clear.
+ *
+ * Input:
+ *  - req (Request): the request.
+ *  - params (const RequestParams&): its door and query parameters.
+ *
+ * Output: None
+ */
+void scheduleRequest(Request req, const RequestParams& params) {
+  if (req == SCHEDULE_CLEAR) {
+    scheduleClear();
+    return;
+  }
+  if (req != LOCK_REQ && req != UNLOCK_REQ) return;
+
+  State st = doors[params.door].fsm.currentState;
+  Command cmd = requestToCommand(req);
+  if (st != BUSY_MOVE && st != (cmd == LOCK_CMD ? LOCK : UNLOCK)) return;
+  if (params.every > 0) {
+    scheduleAdd(params.door, cmd, params.every, params.every);
+  }
+  if (req == UNLOCK_REQ && params.relockAfter > 0) {
+    scheduleAdd(params.door, LOCK_CMD, params.relockAfter, 0);
+  }
+}
+
+/**
+ * Writes the pending timers as CSV: door, command, seconds until the next run
+ * and period (0 for a single run).
+ *
+ * Input:
+ *  - out (Print&): where to write them.
+ *
+ * Output: None
+ */
+void writeSchedule(Print& out) {
+  out.println("door,command,due_in,every");
+  for (int i = 0; i < SCHEDULE_TIMERS; i++) {
+    const ScheduleTimer& t = schedule.timers[i];
+    if (!t.entry.used) continue;
+    unsigned long dueIn = (unsigned long)t.rounds * SCHEDULE_SLOTS +
+                          (t.slot - schedule.cursor + SCHEDULE_SLOTS - 1) % SCHEDULE_SLOTS + 1;
+    out.print(t.entry.door);
+    out.print(t.entry.cmd == LOCK_CMD ? ",lock," : ",unlock,");
+    out.print(dueIn);
+    out.print(',');
+    out.println(t.entry.every);
+  }
+}
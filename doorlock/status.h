@@ -0,0 +1,158 @@
+/*
+ * FULL STATUS
+ *
+ * Everything a dashboard wants to know about a door in one response: its
+ * state and position, its lock and unlock positions, the feedback calibration
+ * of its servo, and the uptime, signal strength and duration of the last
+ * move. `GET /status` keeps returning just the state.
+ *
+ * The same fields are written either as CBOR (RFC 8949), for clients that
+ * send `Accept: application/cbor`, or as JSON for everyone else. Both
+ * encodings are written field by field straight into the response's
+ * `BufferedPrint`, without building the document in memory first.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "wifi_link.h"
+
+// Note: doors, Door, DoorServo and stateToString() must be defined in doorlock.ino
+// before this header is included.
+
+/**
+ * Writes a (possibly nested) map of integers and strings as CBOR or JSON.
+ * CBOR maps have a definite length, so `beginMap()` must be given the number
+ * of keys that follow.
+ */
+class StatusWriter {
+ public:
+  StatusWriter(Print& out, bool cbor) : out(out), cbor(cbor) {}
+
+  void beginMap(uint8_t size) {
+    if (cbor) {
+      head(5, size);
+    } else {
+      out.write('{');
+    }
+    first = true;
+  }
+
+  void endMap() {
+    if (!cbor) out.write('}');
+    first = false;
+  }
+
+  void key(const char* k) {
+    if (cbor) {
+      text(k);
+    } else {
+      if (!first) out.write(',');
+      out.write('"');
+      out.print(k);
+      out.print("\":");
+    }
+    first = false;
+  }
+
+  void value(long v) {
+    if (cbor) {
+      // Major type 0 is an unsigned integer, 1 a negative one stored as -1 - v
+      head(v < 0 ? 1 : 0, v < 0 ? -1 - v : v);
+    } else {
+      out.print(v);
+    }
+  }
+
+  // Strings written here never need escaping in JSON
+  void value(const char* s) {
+    if (cbor) {
+      text(s);
+    } else {
+      out.write('"');
+      out.print(s);
+      out.write('"');
+    }
+  }
+
+ private:
+  Print& out;
+  bool cbor;
+  bool first = true;  // no key written yet in the current map
+
+  // Writes the initial byte of a CBOR item and the shortest encoding of its argument
+  void head(uint8_t major, uint32_t arg) {
+    major <<= 5;
+    if (arg < 24) {
+      out.write(major | arg);
+    } else if (arg <= 0xFF) {
+      out.write(major | 24);
+      out.write(arg);
+    } else if (arg <= 0xFFFF) {
+      out.write(major | 25);
+      out.write(arg >> 8);
+      out.write(arg & 0xFF);
+    } else {
+      out.write(major | 26);
+      for (int shift = 24; shift >= 0; shift -= 8) out.write((arg >> shift) & 0xFF);
+    }
+  }
+
+  void text(const char* s) {
+    size_t len = strlen(s);
+    head(3, len);
+    out.write((const uint8_t*)s, len);
+  }
+};
+
+/**
+ * Writes the full status of a door.
+ *
+ * Input:
+ *  - out (Print&): where to write it.
+ *  - id (int): the door.
+ *  - cbor (bool): whether to write CBOR rather than JSON.
+ *
+ * Output: None
+ */
+void writeFullStatus(Print& out, int id, bool cbor) {
+  const Door& door = doors[id];
+  const DoorServo& servo = door.servo;
+  StatusWriter w(out, cbor);
+
+  w.beginMap(9);
+  w.key("door");
+  w.value((long)id);
+  w.key("state");
+  w.value(stateToString(door.fsm.currentState));
+  w.key("deg");
+  w.value((long)door.lastDeg);
+  w.key("lock_deg");
+  w.value((long)door.fsm.lockDeg);
+  w.key("unlock_deg");
+  w.value((long)door.fsm.unlockDeg);
+
+  w.key("calibration");
+  w.beginMap(6);
+  w.key("min_deg");
+  w.value((long)servo.minDegrees);
+  w.key("max_deg");
+  w.value((long)servo.maxDegrees);
+  w.key("min_feedback");
+  w.value((long)servo.minFeedback);
+  w.key("max_feedback");
+  w.value((long)servo.maxFeedback);
+  w.key("min_po_feedback");
+  w.value((long)servo.minPoFeedback);
+  w.key("max_po_feedback");
+  w.value((long)servo.maxPoFeedback);
+  w.endMap();
+
+  w.key("uptime_s");
+  w.value((long)(millis() / 1000));
+  w.key("rssi_dbm");
+  w.value(wifiLink.rssi);
+  w.key("last_move_ms");
+  w.value((long)door.lastMoveMs);
+  w.endMap();
+}
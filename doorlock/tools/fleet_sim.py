@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+"""
+Fleet gateway check with simulated members.
+
+Runs `--peers` simulated locks on this host, each from its own UDP port and
+with its own device ID, and sends the gateway one signed heartbeat from each
+(see fleet.h). Also sends heartbeats the gateway must drop: a copy of a real
+one from another port, and one whose time is outside the replay window. Then
+checks that GET /fleet lists exactly the real members, and that
+POST /fleet/lock reaches every one of them with a command signed for its
+address, and nothing else.
+
+The gateway's doors move: run it against one that is free to. The clocks of
+this host and the gateway must agree to within the replay window.
+
+Usage: fleet_sim.py GATEWAY PASSWORD [--peers N] [--base-port PORT]
+"""
+
+import argparse
+import hashlib
+import hmac
+import http.client
+import os
+import socket
+import sys
+import time
+
+FLEET_PORT = 4210
+# Numeric `State` values reported by the simulated doors (LOCK, UNLOCK)
+DOOR_STATES = [3, 2]
+
+
+def mac(password, message):
+    return hmac.new(password.encode(), message.encode(), hashlib.sha256).hexdigest()
+
+
+def signed_request(host, password, method, path):
+    nonce = str(int(time.time()))
+    headers = {"X-Nonce": nonce, "X-Signature": mac(password, nonce)}
+    conn = http.client.HTTPConnection(host, timeout=10)
+    try:
+        conn.request(method, path, headers=headers)
+        response = conn.getresponse()
+        return response.status, response.read().decode()
+    finally:
+        conn.close()
+
+
+def local_ip(gateway):
+    probe = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    try:
+        probe.connect((gateway, FLEET_PORT))
+        return probe.getsockname()[0]
+    finally:
+        probe.close()
+
+
+class Peer:
+    def __init__(self, index, ip, port):
+        self.device = "%012x" % (0xD00B00000000 + index)
+        self.address = "%s:%d" % (ip, port)
+        self.boot = os.urandom(4).hex()
+        self.seq = 0
+        self.doors = [DOOR_STATES[(index + d) % 2] for d in range(1 + index % 2)]
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(("", port))
+
+    def heartbeat(self, password, time_offset=0):
+        self.seq += 1
+        msg = "DLHB %s %s %s %d %d 60 %s" % (self.device, self.address, self.boot, self.seq,
+                                             int(time.time()) + time_offset,
+                                             ",".join(str(s) for s in self.doors))
+        return "%s %s\n" % (msg, mac(password, msg)[:16])
+
+
+def receive(sock, timeout):
+    sock.settimeout(timeout)
+    try:
+        return sock.recv(256).decode().strip()
+    except socket.timeout:
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("gateway")
+    parser.add_argument("password")
+    parser.add_argument("--peers", type=int, default=8)
+    parser.add_argument("--base-port", type=int, default=5001)
+    args = parser.parse_args()
+
+    ip = local_ip(args.gateway)
+    peers = [Peer(i, ip, args.base_port + i) for i in range(args.peers)]
+    spoofer = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    spoofer.bind(("", args.base_port + args.peers))
+    gateway = (args.gateway, FLEET_PORT)
+    failures = []
+
+    for peer in peers:
+        datagram = peer.heartbeat(args.password)
+        peer.sock.sendto(datagram.encode(), gateway)
+        # The copy of it from another port must not take the peer's place
+        spoofer.sendto(datagram.encode(), gateway)
+        # The gateway handles a few datagrams per loop()
+        time.sleep(0.1)
+    late = Peer(args.peers + 1, ip, args.base_port + args.peers + 1)
+    late.sock.sendto(late.heartbeat(args.password, time_offset=-3600).encode(), gateway)
+    time.sleep(0.5)
+
+    status, body = signed_request(args.gateway, args.password, "GET", "/fleet")
+    listed = {}
+    for line in body.splitlines():
+        fields = line.split()
+        if len(fields) >= 3 and fields[0] != "self":
+            listed[fields[0]] = fields[2].split(",")
+    if status != 200:
+        failures.append("GET /fleet returned %d" % status)
+    for peer in peers:
+        if peer.address not in listed:
+            failures.append("%s missing from GET /fleet" % peer.address)
+        elif len(listed[peer.address]) != len(peer.doors):
+            failures.append("%s listed with %d doors, not %d" %
+                            (peer.address, len(listed[peer.address]), len(peer.doors)))
+    # Real members elsewhere on the LAN may be listed too
+    for address in listed:
+        if address.startswith(ip + ":") and address not in [peer.address for peer in peers]:
+            failures.append("GET /fleet lists %s, which is not a member" % address)
+
+    status, _ = signed_request(args.gateway, args.password, "POST", "/fleet/lock")
+    if status != 200:
+        failures.append("POST /fleet/lock returned %d" % status)
+    for peer in peers:
+        command = receive(peer.sock, 2)
+        fields = command.split() if command else []
+        if len(fields) != 5 or fields[:3] != ["DLCMD", "lock", ip]:
+            failures.append("%s got %r" % (peer.address, command))
+        elif fields[4] != mac(args.password, " ".join(fields[:4])):
+            failures.append("%s got a command with a bad signature" % peer.address)
+    for sock, name in ((spoofer, "the spoofing port"),
+                       (late.sock, "the peer outside the replay window")):
+        command = receive(sock, 0.5)
+        if command:
+            failures.append("%s got %r" % (name, command))
+
+    for failure in failures:
+        print("FAIL:", failure)
+    print("%d members, %d failures" % (len(peers), len(failures)))
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""
+Command latency under a status poll flood.
+
+Sends lock and unlock commands to a door lock, first alone and then while
+`--pollers` threads poll GET /status as fast as they can, and prints the
+latency of the commands in both runs. With admission control and the read
+drain working, the two should be about the same, and no loop() should come
+near the watchdog interval (see GET /metrics, doorlock_loop_duration_ms).
+
+The door moves: run it against a lock that is free to.
+
+Usage: load_test.py HOST PASSWORD [--pollers N] [--commands N] [--door N]
+"""
+
+import argparse
+import hashlib
+import hmac
+import http.client
+import statistics
+import threading
+import time
+
+
+def signed_headers(password):
+    nonce = str(int(time.time()))
+    signature = hmac.new(password.encode(), nonce.encode(), hashlib.sha256).hexdigest()
+    return {"X-Nonce": nonce, "X-Signature": signature}
+
+
+def request(host, password, method, path, timeout=10):
+    conn = http.client.HTTPConnection(host, timeout=timeout)
+    try:
+        conn.request(method, path, headers=signed_headers(password))
+        response = conn.getresponse()
+        response.read()
+        return response.status
+    finally:
+        conn.close()
+
+
+def poll(host, password, stop, counts):
+    while not stop.is_set():
+        try:
+            status = request(host, password, "GET", "/status")
+        except OSError:
+            status = "error"
+        counts[status] = counts.get(status, 0) + 1
+
+
+def run_commands(host, password, door, commands):
+    latencies = []
+    failures = 0
+    for i in range(commands):
+        action = "lock" if i % 2 == 0 else "unlock"
+        start = time.monotonic()
+        try:
+            status = request(host, password, "POST", "/doors/%d/%s" % (door, action))
+        except OSError:
+            status = None
+        latencies.append((time.monotonic() - start) * 1000)
+        if status != 200:
+            failures += 1
+        # Let the door finish moving before the next command
+        time.sleep(1.5)
+    return latencies, failures
+
+
+def report(title, latencies, failures):
+    latencies = sorted(latencies)
+    p95 = latencies[min(len(latencies) - 1, int(len(latencies) * 0.95))]
+    print("%-14s p50 %7.1f ms  p95 %7.1f ms  max %7.1f ms  failed %d" %
+          (title, statistics.median(latencies), p95, latencies[-1], failures))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("host")
+    parser.add_argument("password")
+    parser.add_argument("--pollers", type=int, default=8)
+    parser.add_argument("--commands", type=int, default=20)
+    parser.add_argument("--door", type=int, default=0)
+    args = parser.parse_args()
+
+    idle = run_commands(args.host, args.password, args.door, args.commands)
+
+    stop = threading.Event()
+    counts = [{} for _ in range(args.pollers)]
+    pollers = [threading.Thread(target=poll, args=(args.host, args.password, stop, c))
+               for c in counts]
+    for t in pollers:
+        t.start()
+    try:
+        loaded = run_commands(args.host, args.password, args.door, args.commands)
+    finally:
+        stop.set()
+        for t in pollers:
+            t.join()
+
+    report("idle", *idle)
+    report("%d pollers" % args.pollers, *loaded)
+    totals = {}
+    for c in counts:
+        for status, n in c.items():
+            totals[status] = totals.get(status, 0) + n
+    print("polls:", ", ".join("%s: %d" % (s, n) for s, n in sorted(totals.items(), key=str)))
+
+
+if __name__ == "__main__":
+    main()
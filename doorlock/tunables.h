@@ -0,0 +1,217 @@
+/*
+ * RUNTIME TUNABLES
+ *
+ * A registry of the timing and position parameters that are worth tuning on
+ * a deployed door, so that trying a new value does not mean reflashing it.
+ * Each tunable is an ordinary global in doorlock.ino, read directly wherever
+ * it is used; the registry only knows its name, type, bounds and default, and
+ * writes it when `POST /tunables/<name>?value=<v>` asks for a new value.
+ *
+ * Values are persisted in the EEPROM with a CRC and loaded at boot, before
+ * anything reads them; a missing or corrupted copy (or one saved by a build
+ * with a different set of tunables) leaves every tunable at its default.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "utils.h"
+
+// Note: TOL, ANGLE_TOLERANCE, MAX_LOCK_ANGLE, MIN_UNLOCK_ANGLE, REPLAY_WINDOW,
+// LOOP_DELAY, wdtInterval, loopBudgetMs(), doors, NUM_DOORS, State and
+// EEPROM_TUNABLES_ADDR must be defined in doorlock.ino before this header is
+// included.
+
+const uint32_t TUNABLES_MAGIC = 0x7E57AB1E;
+
+enum TunableType : uint8_t { TUNABLE_INT, TUNABLE_LONG, TUNABLE_ULONG };
+
+struct Tunable {
+  const char* name;
+  TunableType type;
+  void* value;  // the global holding it, of `type`
+  long min;
+  long max;
+  bool atBoot;  // only read at boot, so a new value takes effect at the next one
+};
+
+const Tunable TUNABLES[] = {
+  {"move_timeout_ms", TUNABLE_ULONG, (void*)&TOL, 1000, 30000, false},
+  {"angle_tolerance_deg", TUNABLE_INT, (void*)&ANGLE_TOLERANCE, 1, 20, false},
+  {"max_lock_angle_deg", TUNABLE_INT, (void*)&MAX_LOCK_ANGLE, 0, 180, true},
+  {"min_unlock_angle_deg", TUNABLE_INT, (void*)&MIN_UNLOCK_ANGLE, 0, 180, true},
+  {"replay_window_s", TUNABLE_ULONG, (void*)&REPLAY_WINDOW, 0, 300, false},
+  {"loop_delay_ms", TUNABLE_ULONG, (void*)&LOOP_DELAY, 0, 1000, false},
+  {"watchdog_interval_ms", TUNABLE_LONG, (void*)&wdtInterval, 1000, 5592, true},
+};
+const int NUM_TUNABLES = sizeof(TUNABLES) / sizeof(TUNABLES[0]);
+
+// The tunables as stored in the EEPROM
+struct TunablesBlock {
+  uint32_t magic;
+  uint32_t count;
+  int32_t values[NUM_TUNABLES];
+  uint32_t crc;  // CRC-32 of the fields above
+};
+
+// Default of each tunable: the value its global was initialized with
+long tunableDefaults[NUM_TUNABLES];
+
+long tunableGet(int i) {
+  switch (TUNABLES[i].type) {
+    case TUNABLE_INT:
+      return *(int*)TUNABLES[i].value;
+    case TUNABLE_LONG:
+      return *(long*)TUNABLES[i].value;
+    case TUNABLE_ULONG:
+      return *(unsigned long*)TUNABLES[i].value;
+  }
+  return 0;
+}
+
+void tunablePut(int i, long v) {
+  switch (TUNABLES[i].type) {
+    case TUNABLE_INT:
+      *(int*)TUNABLES[i].value = v;
+      break;
+    case TUNABLE_LONG:
+      *(long*)TUNABLES[i].value = v;
+      break;
+    case TUNABLE_ULONG:
+      *(unsigned long*)TUNABLES[i].value = v;
+      break;
+  }
+}
+
+/**
+ * Returns whether the tunables make sense together: the lock and unlock
+ * positions are told apart, both the defaults and the positions every door
+ * has been calibrated to, and the loop budget (see `loopBudgetMs()`) fits in
+ * the watchdog timeout.
+ */
+bool tunablesConsistent() {
+  if (MIN_UNLOCK_ANGLE + 2 * ANGLE_TOLERANCE >= MAX_LOCK_ANGLE ||
+      loopBudgetMs() >= (unsigned long)wdtInterval) {
+    return false;
+  }
+  for (int i = 0; i < NUM_DOORS; i++) {
+    const FSMState& fsm = doors[i].fsm;
+    // A door that is still being calibrated has no positions yet
+    if (fsm.currentState == CALIBRATE_LOCK || fsm.currentState == CALIBRATE_UNLOCK) continue;
+    if (fsm.unlockDeg + 2 * ANGLE_TOLERANCE >= fsm.lockDeg) return false;
+  }
+  return true;
+}
+
+/**
+ * Returns the index of the tunable called `name`, or -1 if there is none.
+ */
+int tunableFind(const String& name) {
+  for (int i = 0; i < NUM_TUNABLES; i++) {
+    if (name == TUNABLES[i].name) return i;
+  }
+  return -1;
+}
+
+void tunablesPersist() {
+  TunablesBlock block;
+  block.magic = TUNABLES_MAGIC;
+  block.count = NUM_TUNABLES;
+  for (int i = 0; i < NUM_TUNABLES; i++) {
+    block.values[i] = tunableGet(i);
+  }
+  block.crc = crc32(&block, offsetof(TunablesBlock, crc));
+  EEPROM.put(EEPROM_TUNABLES_ADDR, block);
+}
+
+/**
+ * Sets a tunable and persists the tunables, unless the value is out of its
+ * bounds or inconsistent with the other tunables.
+ *
+ * Input:
+ *  - i (int): the index of the tunable, or -1 for an unknown one.
+ *  - v (unsigned long): its new value.
+ *
+ * Output: bool indicating whether the tunable was set.
+ */
+bool tunableSet(int i, unsigned long v) {
+  if (i < 0 || i >= NUM_TUNABLES || v < (unsigned long)TUNABLES[i].min ||
+      v > (unsigned long)TUNABLES[i].max) {
+    return false;
+  }
+  long old = tunableGet(i);
+  tunablePut(i, v);
+  if (!tunablesConsistent()) {
+    tunablePut(i, old);
+    return false;
+  }
+  if (old != (long)v) tunablesPersist();
+
+  Serial.print("Tunable: ");
+  Serial.print(TUNABLES[i].name);
+  Serial.print(" = ");
+  Serial.println(v);
+  return true;
+}
+
+/**
+ * Records the defaults and loads the persisted tunables, if any. Must be
+ * called once at boot, before anything reads a tunable.
+ *
+ * Input:
+ *  - load (bool): whether to load the persisted tunables; the integration
+ *    tests run with the defaults.
+ *
+ * Output: None
+ */
+void tunablesBegin(bool load = true) {
+  for (int i = 0; i < NUM_TUNABLES; i++) {
+    tunableDefaults[i] = tunableGet(i);
+  }
+  if (!load) return;
+
+  TunablesBlock block;
+  EEPROM.get(EEPROM_TUNABLES_ADDR, block);
+  if (block.magic != TUNABLES_MAGIC || block.count != NUM_TUNABLES ||
+      block.crc != crc32(&block, offsetof(TunablesBlock, crc))) {
+    return;
+  }
+  for (int i = 0; i < NUM_TUNABLES; i++) {
+    if (block.values[i] >= TUNABLES[i].min && block.values[i] <= TUNABLES[i].max) {
+      tunablePut(i, block.values[i]);
+    }
+  }
+  if (!tunablesConsistent()) {
+    for (int i = 0; i < NUM_TUNABLES; i++) {
+      tunablePut(i, tunableDefaults[i]);
+    }
+    Serial.println("Tunables: persisted values inconsistent, using defaults");
+  }
+}
+
+/**
+ * Writes the tunables as CSV: name, value, bounds, default and whether a new
+ * value only takes effect at the next boot.
+ *
+ * Input:
+ *  - out (Print&): where to write them.
+ *
+ * Output: None
+ */
+void writeTunables(Print& out) {
+  out.println("name,value,min,max,default,at_boot");
+  for (int i = 0; i < NUM_TUNABLES; i++) {
+    const Tunable& t = TUNABLES[i];
+    out.print(t.name);
+    out.print(',');
+    out.print(tunableGet(i));
+    out.print(',');
+    out.print(t.min);
+    out.print(',');
+    out.print(t.max);
+    out.print(',');
+    out.print(tunableDefaults[i]);
+    out.println(t.atBoot ? ",1" : ",0");
+  }
+}
@@ -49,3 +49,69 @@ int analogReadStable(byte pin) {
   int sum = 0;
   return (v[1] + v[2] + v[3]) / 3;
 }
+
+/**
+ * A `Print` that collects its output in a fixed-size buffer and forwards it to
+ * another `Print` in chunks.
+ *
+ * Every `print()` on a `WiFiClient` becomes a separate command to the WiFi
+ * module, so writing a response piece by piece is very slow. Wrapping the
+ * client in a `BufferedPrint` sends the same bytes in a few large writes
+ * without allocating any memory.
+ *
+ * The buffer is flushed when it is full, when `flush()` is called, and when
+ * the `BufferedPrint` goes out of scope.
+ */
+class BufferedPrint : public Print {
+ public:
+  static const size_t SIZE = 128;
+
+  BufferedPrint(Print& out) : out(out) {}
+  ~BufferedPrint() { flush(); }
+
+  size_t write(uint8_t c) override {
+    if (len == SIZE) flush();
+    buf[len++] = c;
+    return 1;
+  }
+
+  size_t write(const uint8_t* data, size_t size) override {
+    for (size_t i = 0; i < size; i++) write(data[i]);
+    return size;
+  }
+
+  void flush() override {
+    if (len == 0) return;
+    out.write(buf, len);
+    len = 0;
+  }
+
+ private:
+  Print& out;
+  uint8_t buf[SIZE];
+  size_t len = 0;
+};
+
+/**
+ * Computes the CRC-32 (IEEE 802.3, as used by zlib) of `len` bytes, bit by bit
+ * so that no lookup table is needed.
+ *
+ * Input:
+ *  - data (const void*): the bytes to checksum.
+ *  - len (size_t): number of bytes.
+ *  - crc (uint32_t): CRC of the preceding bytes when checksumming in pieces,
+ *    0 otherwise.
+ *
+ * Output: the CRC-32 of the bytes.
+ */
+uint32_t crc32(const void* data, size_t len, uint32_t crc = 0) {
+  const uint8_t* p = (const uint8_t*)data;
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= p[i];
+    for (int b = 0; b < 8; b++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
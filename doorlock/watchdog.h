@@ -0,0 +1,190 @@
+/*
+ * WATCHDOG BUDGET MONITOR
+ *
+ * Keeps track of how close each loop() iteration comes to the watchdog
+ * timeout, and leaves breadcrumbs (current loop phase, FSM state and last
+ * request) in a RAM area that is not cleared on reset. When the watchdog does
+ * fire, the breadcrumbs of the stalled iteration are still there at the next
+ * boot and get reported.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <WDT.h>
+#include "profiler.h"
+
+// Note: State, Request, NUM_STATES, NUM_REQUEST_TYPES, NUM_DOORS, stateToString(),
+// requestToRoute(), wdtInterval and WDT_WARN_PERCENT must be defined in
+// doorlock.ino before this header is included.
+
+// Reasons for the last reset, as reported by the RA4M1 reset status registers
+enum ResetCause {
+  RESET_PIN,
+  RESET_POWER_ON,
+  RESET_LOW_VOLTAGE,
+  RESET_WATCHDOG,
+  RESET_SOFTWARE
+};
+
+// Changes whenever the layout of CrashRecord does
+const uint32_t CRASH_RECORD_MAGIC = 0xD00B10C6;
+
+// What the lock was doing, updated as loop() goes through its phases
+struct CrashRecord {
+  uint32_t magic;
+  uint8_t phase;
+  uint8_t request;
+  uint8_t states[NUM_DOORS];  // FSM state of each door
+  unsigned long lastRefreshMs;  // millis() of the last successful WDT.refresh()
+};
+
+// Lives in `.noinit`, so it is neither zeroed nor initialized by the startup
+// code and survives a watchdog reset (but not a power cycle).
+CrashRecord crashRecord __attribute__((section(".noinit")));
+
+struct WatchdogStats {
+  unsigned long lastRefreshMs;
+  unsigned long worstIntervalMs;  // longest time between two refreshes
+  unsigned long warnings;         // refreshes later than WDT_WARN_PERCENT of the budget
+  bool hasLastCrash;
+  CrashRecord lastCrash;          // breadcrumbs of the iteration that tripped the watchdog
+};
+
+WatchdogStats watchdogStats;
+
+/**
+ * Reads (and clears) the reset status registers of the RA4M1 to find out why
+ * the board last reset. Should be called once, early in `setup()`.
+ *
+ * Input: None
+ *
+ * Output: the cause of the last reset.
+ */
+ResetCause readResetCause() {
+  ResetCause cause = RESET_PIN;  // No flag is set after an external reset
+  if (R_SYSTEM->RSTSR1_b.WDTRF || R_SYSTEM->RSTSR1_b.IWDTRF) {
+    cause = RESET_WATCHDOG;
+  } else if (R_SYSTEM->RSTSR1_b.SWRF) {
+    cause = RESET_SOFTWARE;
+  } else if (R_SYSTEM->RSTSR0_b.PORF) {
+    cause = RESET_POWER_ON;
+  } else if (R_SYSTEM->RSTSR0_b.LVD0RF || R_SYSTEM->RSTSR0_b.LVD1RF ||
+             R_SYSTEM->RSTSR0_b.LVD2RF) {
+    cause = RESET_LOW_VOLTAGE;
+  }
+
+  // The flags can only be cleared by writing 0 after reading 1, otherwise they
+  // would still be set after the next (unrelated) reset.
+  R_SYSTEM->RSTSR0 = 0;
+  R_SYSTEM->RSTSR1 = 0;
+  return cause;
+}
+
+const char* resetCauseToString(ResetCause cause) {
+  switch (cause) {
+    case RESET_PIN:
+      return "pin";
+    case RESET_POWER_ON:
+      return "power_on";
+    case RESET_LOW_VOLTAGE:
+      return "low_voltage";
+    case RESET_WATCHDOG:
+      return "watchdog";
+    case RESET_SOFTWARE:
+      return "software";
+  }
+  return "unknown";
+}
+
+inline void watchdogPhase(Phase phase) { crashRecord.phase = phase; }
+inline void watchdogState(int door, State st) { crashRecord.states[door] = st; }
+
+/**
+ * Returns whether the breadcrumbs are all in range, i.e. were left by this
+ * build and not garbage found in RAM after a power cycle.
+ */
+bool crashRecordValid(const CrashRecord& record) {
+  if (record.magic != CRASH_RECORD_MAGIC || record.phase >= NUM_PHASES ||
+      record.request >= NUM_REQUEST_TYPES) {
+    return false;
+  }
+  for (int d = 0; d < NUM_DOORS; d++) {
+    if (record.states[d] >= NUM_STATES) return false;
+  }
+  return true;
+}
+inline void watchdogRequest(Request req) { crashRecord.request = req; }
+
+/**
+ * Reports the breadcrumbs left by the previous boot if it ended in a
+ * watchdog reset, then arms the watchdog.
+ *
+ * Input:
+ *  - cause (ResetCause): why the board last reset.
+ *
+ * Output: None
+ *
+ * Side effects: prints the crash record (if any) to the serial console,
+ * resets the breadcrumbs and starts the watchdog.
+ */
+void watchdogBegin(ResetCause cause) {
+  if (cause == RESET_WATCHDOG && crashRecordValid(crashRecord)) {
+    watchdogStats.hasLastCrash = true;
+    watchdogStats.lastCrash = crashRecord;
+
+    Serial.print("Watchdog reset during ");
+    Serial.print(phaseToString((Phase)crashRecord.phase));
+    Serial.print(", states=");
+    for (int d = 0; d < NUM_DOORS; d++) {
+      if (d > 0) Serial.print(',');
+      Serial.print(stateToString((State)crashRecord.states[d]));
+    }
+    Serial.print(", last request=");
+    Serial.print(requestToRoute((Request)crashRecord.request));
+    Serial.print(", last refresh at ");
+    Serial.print(crashRecord.lastRefreshMs);
+    Serial.println(" ms");
+  }
+
+  crashRecord.magic = CRASH_RECORD_MAGIC;
+  crashRecord.phase = PHASE_ACCEPT;
+  memset(crashRecord.states, BAD, sizeof(crashRecord.states));
+  crashRecord.request = EMPTY;
+  crashRecord.lastRefreshMs = millis();
+
+  watchdogStats.lastRefreshMs = millis();
+  WDT.begin(wdtInterval);
+}
+
+/**
+ * Pets the watchdog and checks how much of its budget the last iteration
+ * used.
+ *
+ * Input: None
+ * Output: None
+ *
+ * Side effects: refreshes the watchdog, updates `watchdogStats` and prints a
+ * warning when the time since the last refresh exceeded WDT_WARN_PERCENT of
+ * `wdtInterval`.
+ */
+void watchdogRefresh() {
+  WDT.refresh();
+
+  unsigned long now = millis();
+  unsigned long interval = now - watchdogStats.lastRefreshMs;
+  watchdogStats.lastRefreshMs = now;
+  crashRecord.lastRefreshMs = now;
+
+  if (interval > watchdogStats.worstIntervalMs) {
+    watchdogStats.worstIntervalMs = interval;
+  }
+  if (interval * 100 > (unsigned long)wdtInterval * WDT_WARN_PERCENT) {
+    watchdogStats.warnings++;
+    Serial.print("Watchdog warning: ");
+    Serial.print(interval);
+    Serial.print(" ms since last refresh, budget is ");
+    Serial.print(wdtInterval);
+    Serial.println(" ms");
+  }
+}
@@ -0,0 +1,170 @@
+/*
+ * CACHED WIFI LEASE
+ *
+ * Remembers the IP configuration (and, for diagnostics, the BSSID) of the last
+ * successful WiFi connection in EEPROM. On the next boot the lease is applied
+ * as a static configuration before `WiFi.begin()`, so the lock does not have to
+ * wait for a DHCP exchange after every reset.
+ *
+ * A cached lease is only used while it has not expired: the cache holds the
+ * Unix time (from the WiFi module's NTP clock) the lease was obtained and its
+ * lease time, `WIFI_LEASE_TIME_S`. Once it is older than that, the DHCP server
+ * may have handed the address to another host. The age is checked before the
+ * lease is applied, against the newest authenticated timestamp (a lower bound
+ * of the time), and again once connected, against the module's clock; a lease
+ * whose age cannot be told is not trusted. The gateway must also answer a
+ * ping. If either check fails, the lease is forgotten and the lock joins again
+ * through DHCP, in the same boot.
+ *
+ * The WiFiS3 library cannot join a specific BSSID or channel, so those parts
+ * of the scan cannot be skipped; the BSSID is only used to notice that the
+ * lock has moved to another access point.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <WiFiS3.h>
+#include "utils.h"
+
+// Note: EEPROM_WIFI_CACHE_ADDR and EEPROM_TIMESTAMP_ADDR must be defined in
+// doorlock.ino before this header is included.
+
+// Lease time handed out by the DHCP server (seconds); define it in config.h if
+// the router's is shorter
+#ifndef WIFI_LEASE_TIME_S
+#define WIFI_LEASE_TIME_S 86400
+#endif
+
+// Changes whenever the layout of WifiCache does
+const uint32_t WIFI_CACHE_MAGIC = 0x57494632;  // "WIF2"
+
+struct WifiCache {
+  uint32_t magic;
+  uint32_t ssidCrc;  // the cache is only valid for the network it came from
+  uint8_t ip[4];
+  uint8_t gateway[4];
+  uint8_t subnet[4];
+  uint8_t dns[4];
+  uint8_t bssid[6];
+  uint8_t reserved[2];
+  uint32_t obtainedAt;  // Unix time the lease was obtained
+  uint32_t leaseS;      // lease time, in seconds
+  uint32_t crc;         // CRC-32 of every field above
+};
+
+WifiCache wifiCache;
+bool wifiCacheUsed = false;
+
+void ipToBytes(const IPAddress& ip, uint8_t out[4]) {
+  for (int i = 0; i < 4; i++) out[i] = ip[i];
+}
+
+IPAddress bytesToIp(const uint8_t b[4]) { return IPAddress(b[0], b[1], b[2], b[3]); }
+
+/**
+ * Loads the cached lease for `ssid` from EEPROM and, if there is a valid one,
+ * configures the WiFi module to use it instead of DHCP. Must be called before
+ * the first `WiFi.begin()`.
+ *
+ * Input:
+ *  - ssid (const char*): the network about to be joined.
+ *
+ * Output: bool indicating whether a cached lease was applied.
+ */
+bool applyWifiCache(const char* ssid) {
+  EEPROM.get(EEPROM_WIFI_CACHE_ADDR, wifiCache);
+  if (wifiCache.magic != WIFI_CACHE_MAGIC ||
+      wifiCache.ssidCrc != crc32(ssid, strlen(ssid)) ||
+      wifiCache.crc != crc32(&wifiCache, offsetof(WifiCache, crc))) {
+    Serial.println("No cached WiFi lease, using DHCP");
+    wifiCacheUsed = false;
+    return false;
+  }
+  unsigned long lastTimestamp = 0;
+  EEPROM.get(EEPROM_TIMESTAMP_ADDR, lastTimestamp);
+  if (lastTimestamp > wifiCache.obtainedAt &&
+      lastTimestamp - wifiCache.obtainedAt >= wifiCache.leaseS) {
+    Serial.println("Cached WiFi lease expired, using DHCP");
+    wifiCacheUsed = false;
+    return false;
+  }
+
+  IPAddress ip = bytesToIp(wifiCache.ip);
+  WiFi.config(ip, bytesToIp(wifiCache.dns), bytesToIp(wifiCache.gateway),
+              bytesToIp(wifiCache.subnet));
+  Serial.print("Using cached WiFi lease ");
+  Serial.println(ip);
+  wifiCacheUsed = true;
+  return true;
+}
+
+/**
+ * Returns whether the connection made with the cached lease can be used: the
+ * module's clock shows the lease has not expired, and the gateway of the
+ * lease answers a ping. A gateway that never answers pings only costs the
+ * cache, not the connection.
+ */
+bool wifiCacheLeaseWorks() {
+  unsigned long now = WiFi.getTime();
+  if (now == 0 || now - wifiCache.obtainedAt >= wifiCache.leaseS) {
+    Serial.println(now == 0 ? "Cannot tell the age of the cached WiFi lease"
+                            : "Cached WiFi lease expired");
+    return false;
+  }
+  int rtt = WiFi.ping(bytesToIp(wifiCache.gateway));
+  Serial.print("Ping to the gateway of the cached lease: ");
+  Serial.println(rtt);
+  return rtt >= 0;
+}
+
+/**
+ * Stores the configuration of the current connection, just obtained through
+ * DHCP, in EEPROM. Nothing is stored while the module does not know the time,
+ * as the lease could never be told apart from an expired one.
+ *
+ * Input:
+ *  - ssid (const char*): the network that was joined.
+ *
+ * Output: None
+ */
+void saveWifiCache(const char* ssid) {
+  unsigned long now = WiFi.getTime();
+  if (now == 0) return;
+
+  WifiCache fresh = {};
+  fresh.magic = WIFI_CACHE_MAGIC;
+  fresh.ssidCrc = crc32(ssid, strlen(ssid));
+  ipToBytes(WiFi.localIP(), fresh.ip);
+  ipToBytes(WiFi.gatewayIP(), fresh.gateway);
+  ipToBytes(WiFi.subnetMask(), fresh.subnet);
+  ipToBytes(WiFi.dnsIP(), fresh.dns);
+  WiFi.BSSID(fresh.bssid);
+  fresh.obtainedAt = now;
+  fresh.leaseS = WIFI_LEASE_TIME_S;
+  fresh.crc = crc32(&fresh, offsetof(WifiCache, crc));
+
+  if (wifiCacheUsed && memcmp(fresh.bssid, wifiCache.bssid, sizeof(fresh.bssid)) != 0) {
+    Serial.println("Joined a different access point than last time");
+  }
+  wifiCache = fresh;
+  EEPROM.put(EEPROM_WIFI_CACHE_ADDR, wifiCache);
+  Serial.println("Saved WiFi lease to EEPROM");
+}
+
+/**
+ * Forgets the cached lease and goes back to DHCP, so that the next
+ * `WiFi.begin()` (in this boot or the next) asks for a new lease. Used when
+ * the cached lease does not work.
+ *
+ * Input: None
+ * Output: None
+ */
+void clearWifiCache() {
+  wifiCache.magic = 0;
+  EEPROM.put(EEPROM_WIFI_CACHE_ADDR, wifiCache);
+  WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE, INADDR_NONE);
+  wifiCacheUsed = false;
+  Serial.println("Cleared cached WiFi lease, using DHCP");
+}
@@ -0,0 +1,121 @@
+/*
+ * WIFI LINK SUPERVISOR
+ *
+ * Watches the WiFi connection from loop() and reconnects when it drops (e.g.
+ * because the access point restarted), with exponential backoff between
+ * attempts. Every step is non-blocking, or bounded by the loop budget, so
+ * supervising the link never stalls the FSM.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiS3.h>
+
+// Note: ssid, pass (if SECRET_PASS is defined), status, server and
+// RECONNECT_BEGIN_TIMEOUT (the loop budget) must be defined in doorlock.ino
+// before this header is included.
+
+// How often the link state is checked (milliseconds)
+const unsigned long LINK_CHECK_INTERVAL = 1000;
+// How often the signal strength is sampled while connected (milliseconds)
+const unsigned long RSSI_SAMPLE_INTERVAL = 10000;
+// Backoff between reconnect attempts (milliseconds)
+const unsigned long RECONNECT_BACKOFF_MIN = 1000;
+const unsigned long RECONNECT_BACKOFF_MAX = 60000;
+
+struct WifiLink {
+  bool up;
+  unsigned long lastCheckMs;
+  unsigned long lastRssiMs;
+  long rssi;                     // last sample, dBm
+  long minRssi;                  // weakest sample since boot, dBm
+  unsigned long downSinceMs;     // when the current outage started
+  unsigned long downtimeMs;      // total length of past outages
+  unsigned long disconnects;
+  unsigned long reconnectAttempts;
+  unsigned long backoffMs;
+  unsigned long lastAttemptMs;
+};
+
+WifiLink wifiLink = {true, 0, 0, 0, 0, 0, 0, 0, 0, RECONNECT_BACKOFF_MIN, 0};
+
+/**
+ * Returns the total time the link has been down since boot, including the
+ * current outage, in milliseconds.
+ */
+unsigned long wifiDowntimeMs() {
+  if (wifiLink.up) return wifiLink.downtimeMs;
+  return wifiLink.downtimeMs + (millis() - wifiLink.downSinceMs);
+}
+
+/**
+ * Starts a reconnect attempt without waiting for it to finish.
+ *
+ * Input: None
+ * Output: None
+ */
+void wifiLinkReconnect() {
+  wifiLink.reconnectAttempts++;
+  Serial.print("Reconnecting to ");
+  Serial.print(ssid);
+  Serial.print(", attempt ");
+  Serial.println(wifiLink.reconnectAttempts);
+
+  wifiLink.lastAttemptMs = millis();
+  WiFi.disconnect();
+  WiFi.setTimeout(RECONNECT_BEGIN_TIMEOUT);
+#ifdef SECRET_PASS
+  status = WiFi.begin(ssid, pass);
+#else
+  status = WiFi.begin(ssid);
+#endif
+}
+
+/**
+ * Checks the WiFi link and drives reconnection. Meant to be called every
+ * loop(); it does nothing until `LINK_CHECK_INTERVAL` has passed since the
+ * last check.
+ *
+ * Input: None
+ * Output: None
+ *
+ * Side effects: updates `wifiLink` and `status`, starts reconnect attempts
+ * while the link is down and restarts the HTTP server once it is back.
+ */
+void wifiLinkPoll() {
+  unsigned long now = millis();
+  if (now - wifiLink.lastCheckMs < LINK_CHECK_INTERVAL) return;
+  wifiLink.lastCheckMs = now;
+
+  status = WiFi.status();
+  bool connected = (status == WL_CONNECTED);
+
+  if (wifiLink.up && !connected) {
+    wifiLink.up = false;
+    wifiLink.downSinceMs = now;
+    wifiLink.disconnects++;
+    wifiLink.backoffMs = RECONNECT_BACKOFF_MIN;
+    Serial.println("WiFi link lost");
+    wifiLinkReconnect();
+  } else if (!wifiLink.up && connected) {
+    wifiLink.up = true;
+    wifiLink.downtimeMs += now - wifiLink.downSinceMs;
+    server.begin();
+    Serial.print("WiFi link restored after ");
+    Serial.print(now - wifiLink.downSinceMs);
+    Serial.println(" ms");
+  } else if (!wifiLink.up && now - wifiLink.lastAttemptMs >= wifiLink.backoffMs) {
+    wifiLink.backoffMs = min(wifiLink.backoffMs * 2, RECONNECT_BACKOFF_MAX);
+    wifiLinkReconnect();
+  }
+
+  bool rssiDue = (wifiLink.lastRssiMs == 0 || now - wifiLink.lastRssiMs >= RSSI_SAMPLE_INTERVAL);
+  if (wifiLink.up && rssiDue) {
+    wifiLink.lastRssiMs = now;
+    wifiLink.rssi = WiFi.RSSI();
+    if (wifiLink.minRssi == 0 || wifiLink.rssi < wifiLink.minRssi) {
+      wifiLink.minRssi = wifiLink.rssi;
+    }
+  }
+}